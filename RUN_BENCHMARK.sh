@@ -0,0 +1,3 @@
+clang++ -std=c++11 -O2 -march=native -pthread -I. -Wall src/benchmark.cpp -o bin/kD-tree-benchmark
+
+./bin/kD-tree-benchmark
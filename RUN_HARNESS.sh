@@ -0,0 +1,3 @@
+clang++ -std=c++11 -O2 -march=native -pthread -I. -Wall src/harness.cpp -o bin/kD-tree-harness
+
+./bin/kD-tree-harness "$@"
@@ -1,3 +1,3 @@
-clang++ -std=c++11 -I. -Wall src/main.cpp -o bin/kD-tree
+clang++ -std=c++11 -pthread -I. -Wall src/main.cpp -o bin/kD-tree
 
 ./bin/kD-tree
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+
+#include "kd_tree.h"
+
+namespace Analysis {
+
+/**
+ * Shares a kd_tree between any number of reader threads and writers that
+ * replace it as a whole, e.g. with a tree rebuilt in the background
+ * Readers query inside read(), which takes no locks: it counts the thread in
+ * as a reader (one atomic increment, in the counter of the current epoch) and
+ * hands the current tree to a function, during which the tree stays valid
+ * Writers swap a new tree in and then wait for a grace period, until every
+ * reader that may still see the old tree has left, before destroying it
+ * (read-copy-update); new readers are counted in the other counter, so that
+ * writers only wait for the queries that were already running
+ * read() must not publish to or rebuild the same object (it would wait for
+ * itself)
+ */
+template<class Key, class T,
+         class Compare = std::less<typename kd_key_traits<Key>::subkey_type>,
+         class Equate  = std::equal_to<typename kd_key_traits<Key>::subkey_type>,
+         class Alloc   = std::allocator<std::pair<const Key, const T> > >
+class concurrent_kd_tree {
+public:
+
+  using tree_type  = kd_tree<Key, T, Compare, Equate, Alloc>;
+  using value_type = typename tree_type::value_type;
+  using size_type  = std::size_t;
+
+private:
+
+  // on separate cache lines, as every reader writes to one of them
+  struct alignas(64) reader_count {
+    std::atomic<size_t> count { 0 };
+  };
+
+  // counts the calling thread as a reader while it's in scope
+  class read_section {
+    std::atomic<size_t> &m_count;
+
+  public:
+    explicit read_section (const concurrent_kd_tree &tree) :
+      m_count(tree.m_readers[tree.m_epoch.load() & 1].count)
+    {
+      m_count.fetch_add(1);
+    }
+
+    read_section (const read_section&) = delete;
+    read_section &operator= (const read_section&) = delete;
+
+    ~read_section () {
+      m_count.fetch_sub(1, std::memory_order_release);
+    }
+  };
+
+  std::atomic<const tree_type*> m_current { nullptr };
+  mutable std::atomic<size_t>   m_epoch { 0 };
+  mutable reader_count          m_readers[2];
+  std::mutex                    m_writer;   // one publish at a time
+  std::mutex                    m_rebuilds;
+  std::vector<std::shared_future<void>> m_pending;
+
+  void Synchronize ();
+
+public:
+
+  /**
+   * Starts with an empty tree of keys with dim coordinates
+   */
+  explicit concurrent_kd_tree (const size_t &dim);
+  explicit concurrent_kd_tree (tree_type &&tree);
+  explicit concurrent_kd_tree (std::unique_ptr<const tree_type> tree);
+
+  concurrent_kd_tree (const concurrent_kd_tree&) = delete;
+  concurrent_kd_tree &operator= (const concurrent_kd_tree&) = delete;
+
+  /**
+   * Waits for the rebuilds still running; there must be no readers left
+   */
+  ~concurrent_kd_tree ();
+
+  /**
+   * Calls f with the current tree and returns what it returns
+   * The tree is not destroyed until f returns, even if a newer one is
+   * published meanwhile (references into it must not outlive f)
+   */
+  template<class Function>
+  auto read (Function f) const -> decltype(f(std::declval<const tree_type&>()))
+  {
+    read_section section(*this);
+    return f(*m_current.load());
+  }
+
+  size_type size () const {
+    return this->read([](const tree_type &tree) {return tree.size();});
+  }
+
+  /**
+   * Replaces the tree, returning once no reader can see the old one anymore
+   * (it has been destroyed by then)
+   */
+  void publish (std::unique_ptr<const tree_type>);
+  void publish (tree_type &&tree)
+  {this->publish(std::unique_ptr<const tree_type>(new tree_type(std::move(tree))));}
+
+  /**
+   * Builds a tree on a new thread with build(), which should return a
+   * tree_type, and publishes it; readers carry on with the current tree
+   * meanwhile
+   * The future becomes ready once the tree is published, and holds the
+   * exception if build throws; concurrent rebuilds publish in the order they
+   * finish
+   */
+  template<class Builder>
+  std::shared_future<void> rebuild (Builder build);
+};
+}
+
+#include "concurrent_kd_tree.icc"
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <forward_list>
+#include <functional>
+#include <initializer_list>
+
+#include "kd_tree.h"
+
+namespace Analysis {
+
+struct dynamic_kd_tree_options {
+  // inserts are collected unsorted until there are this many
+  size_t buffer_size { 512 };
+  // a component tree is rebuilt once more than this fraction of it is erased
+  double compact_ratio { 0.5 };
+  // options of the component trees
+  kd_tree_options tree;
+};
+
+
+/**
+ * Updatable k-D tree (Bentley-Saxe logarithmic method)
+ * Keys are kept in a small unsorted insert buffer and in static kd_trees
+ * whose capacities double from one level to the next; a full buffer is
+ * merged with the occupied levels below the first free one into a single new
+ * tree, so every key is rebuilt O(log n) times (amortized O(log^2 n) per
+ * insert)
+ * Erased keys are only marked (tombstones) and are dropped when their tree is
+ * rebuilt, which happens by itself once more than compact_ratio of a tree is
+ * erased, or for all trees at once with compact()
+ * Keys are unique as in kd_tree: inserting a key that is already present
+ * replaces its value
+ * Queries visit every component; references to the results are valid until
+ * the next modification
+ */
+template<class Key, class T,
+         class Compare = std::less<typename kd_key_traits<Key>::subkey_type>,
+         class Equate  = std::equal_to<typename kd_key_traits<Key>::subkey_type>,
+         class Alloc   = std::allocator<std::pair<const Key, const T> > >
+class dynamic_kd_tree {
+public:
+
+  using tree_type   = kd_tree<Key, T, Compare, Equate, Alloc>;
+  using key_type    = Key;
+  using stored_type = T;
+  using subkey_type = typename tree_type::subkey_type;
+  using value_type  = typename tree_type::value_type;
+  using size_type   = std::size_t;
+
+private:
+
+  struct level {
+    std::unique_ptr<tree_type> tree;
+    std::vector<bool> erased;  // by position in the tree's values
+    size_t erasedCount { 0 };
+  };
+
+  size_t  m_dim;
+  size_t  m_size { 0 };
+  Compare m_comp;
+  Equate  m_equate;
+  Alloc   m_alloc;
+  dynamic_kd_tree_options m_options;
+  std::vector<value_type> m_buffer;
+  std::vector<bool>       m_bufferErased;
+  std::vector<level>      m_levels;
+
+  size_t Dim () const noexcept {
+    return kd_key_traits<Key>::dimension != 0 ? kd_key_traits<Key>::dimension : m_dim;
+  }
+
+  size_t Capacity (const size_t &l) const noexcept {
+    return std::max<size_t>(m_options.buffer_size, 1) << (l + 1);
+  }
+
+  void Flush ();
+  void Gather (level&, std::vector<std::pair<Key, T>>&);
+  void Rebuild (const size_t&, std::vector<std::pair<Key, T>>&);
+  bool SameKey (const Key&, const Key&) const;
+  template<class Container>
+  bool InBox (const Key&, const Container&) const;
+  template<class Metric, class Container>
+  double Distance (const Key&, const Container&) const;
+
+public:
+
+  explicit dynamic_kd_tree (const size_t &dim,
+                            const dynamic_kd_tree_options &options = dynamic_kd_tree_options(),
+                            const Alloc &alloc = Alloc());
+
+  /**
+   * Takes random-access iterators to pairs of the form std::pair<Key, T> (see
+   * kd_tree) and builds them into a single component
+   */
+  template<class RandomAccessIterator>
+  dynamic_kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&,
+                   const dynamic_kd_tree_options &options = dynamic_kd_tree_options(),
+                   const Alloc &alloc = Alloc());
+
+  size_type size () const noexcept {
+    return m_size;
+  }
+
+  bool empty () const noexcept {
+    return m_size == 0;
+  }
+
+  /**
+   * Inserts a key-value pair, replacing the value of the key if it is already
+   * in the tree
+   * Returns true if the key is new
+   */
+  bool insert (const Key&, const T&);
+  /**
+   * Removes a key; returns the number of removed pairs (0 or 1)
+   */
+  size_type erase (const Key&);
+  /**
+   * Returns the pair with the given key, or nullptr
+   */
+  const value_type *find (const Key&) const;
+  /**
+   * Rebuilds everything into a single tree without tombstones
+   */
+  void compact ();
+  void clear ();
+
+  /**
+   * Same queries as kd_tree, over all components
+   */
+  template<class Container>
+  std::forward_list < std::reference_wrapper < const value_type >> operator[](const Container&) const;
+
+  std::forward_list < std::reference_wrapper < const value_type >>
+  operator[](std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->operator[]<decltype(l)>(l);}
+
+  template<class Container, class Function>
+  void for_each_in (const Container&, Function) const;
+
+  template<class Function>
+  void for_each_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l, Function f) const
+  {this->for_each_in<decltype(l), Function>(l, f);}
+
+  template<class Container>
+  size_type count (const Container&) const;
+
+  size_type count (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->count<decltype(l)>(l);}
+
+  template<class Container>
+  bool any_in (const Container&) const;
+
+  bool any_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->any_in<decltype(l)>(l);}
+
+  template<class Metric = kd_metric::L2, class Container>
+  std::vector < std::reference_wrapper < const value_type >>
+  nearest (const Container&, const size_t&, const double &epsilon = 0) const;
+
+  template<class Metric = kd_metric::L2>
+  std::vector < std::reference_wrapper < const value_type >>
+  nearest (std::initializer_list<subkey_type> l, const size_t &k, const double &epsilon = 0) const
+  {return this->nearest<Metric>(std::vector<subkey_type>(l), k, epsilon);}
+
+  template<class Metric = kd_metric::L2, class Container, class Function>
+  void for_each_within (const Container&, const double&, Function) const;
+
+  template<class Metric = kd_metric::L2, class Container>
+  size_type count_within (const Container&, const double&) const;
+
+  // number of component trees (not counting the insert buffer)
+  size_type components () const noexcept;
+};
+}
+
+#include "dynamic_kd_tree.icc"
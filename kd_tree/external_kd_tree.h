@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <fstream>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <initializer_list>
+
+#include "kd_tree.h"
+
+namespace Analysis {
+
+/**
+ * Layout of the key-value pairs in the input file of an external_kd_tree: the
+ * file is a packed array of these records
+ */
+template<class Key, class T>
+struct kd_record {
+  Key key;
+  T   value;
+};
+
+
+struct external_kd_tree_options {
+  // bytes the build may use at once; runs are partitioned on disk until the
+  // (rough) peak of building one in memory fits
+  size_t memory_budget { size_t(1) << 30 };
+  // keys sampled from a run to choose the splits that partition it
+  size_t sample_size { 1 << 16 };
+  // runs written by one partitioning pass (files open at once)
+  size_t fanout { 64 };
+  // subtrees kept mapped by queries (the least recently used are unmapped)
+  size_t max_open { 256 };
+  // options of the subtrees
+  kd_tree_options tree;
+};
+
+
+namespace kd_tree_internal {
+
+/**
+ * Node of the upper levels of an external tree, laid out in pre-order as
+ * kd_node (the median is stored separately); leaves are subtrees saved in
+ * their own files, or empty
+ */
+struct kd_top_node {
+  index_type axis;
+  index_type right;
+  index_type subtree;
+};
+
+constexpr index_type no_subtree = std::numeric_limits<index_type>::max();
+
+/**
+ * Header of the index of an external tree, followed by the top nodes, their
+ * medians, the number of keys of every subtree and their bounding boxes
+ */
+struct kd_index_header {
+  char          magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint64_t key_size, stored_size, subkey_size, subkey_kind;
+  std::uint64_t dim, node_count, subtree_count, key_count;
+  std::uint64_t payload_checksum;
+  std::uint64_t header_checksum;  // of all of the above
+};
+
+constexpr char          index_magic[8] = { 'k', 'd', '-', 'i', 'n', 'd', 'e', 'x' };
+constexpr std::uint32_t index_version  = 1;
+
+} // kd_tree_internal
+
+
+/**
+ * k-D tree over more key-value pairs than fit in memory, stored in a
+ * directory (which must exist)
+ * The build streams a file of kd_record<Key, T> through bounded memory: the
+ * keys of a run (at first the whole input) are sampled to choose the splits
+ * that partition it into up to fanout runs on disk in a single pass, and runs
+ * still too large for memory_budget are partitioned again. Each run that fits
+ * is built into a kd_tree and saved next to the index. Equal keys always end
+ * up in the same run, so keys stay unique (the last pair of the input wins,
+ * as in kd_tree); a run whose sample holds a single key is streamed once more
+ * to drop all but the last pair with that key
+ * The splits form the upper levels of the tree, which stay in memory along
+ * with the bounding box of every subtree. Queries open the subtrees they
+ * reach as mapped kd_trees (see kd_tree::open), whose pages are read as they
+ * are visited, and keep at most max_open of them mapped
+ * Key and T must be trivially copyable; only box queries
+ */
+template<class Key, class T,
+         class Compare = std::less<typename kd_key_traits<Key>::subkey_type>,
+         class Equate  = std::equal_to<typename kd_key_traits<Key>::subkey_type> >
+class external_kd_tree {
+public:
+
+  using tree_type   = kd_tree<Key, T, Compare, Equate>;
+  using key_type    = Key;
+  using stored_type = T;
+  using subkey_type = typename tree_type::subkey_type;
+  using value_type  = typename tree_type::value_type;
+  using record_type = kd_record<Key, T>;
+  using size_type   = std::size_t;
+
+private:
+
+  using index_type = kd_tree_internal::index_type;
+
+  // splits of one partitioning pass, chosen on the sample of a run
+  struct split_node {
+    size_t      axis;
+    subkey_type median;
+    index_type  right;
+    index_type  part;
+  };
+
+  // mapped subtrees, least recently used last
+  struct subtree_cache {
+    std::mutex lock;
+    std::vector<std::shared_ptr<const tree_type>> trees;
+    std::list<index_type> recent;
+    std::vector<std::list<index_type>::iterator> position;
+  };
+
+  size_t      m_dim;
+  std::string m_directory;
+  Compare     m_comp;
+  Equate      m_equate;
+  size_t      m_size { 0 };
+  size_t      m_maxOpen;
+  bool        m_verify { false };
+  size_t      m_runs { 0 };  // temporary run files named so far
+  std::vector<kd_tree_internal::kd_top_node> m_nodes;
+  std::vector<subkey_type>   m_medians;
+  // keys of every subtree, and their bounding boxes (the minima and then the
+  // maxima of all coordinates)
+  std::vector<std::uint64_t> m_counts;
+  std::vector<subkey_type>   m_bounds;
+  std::unique_ptr<subtree_cache> m_cache;
+
+  size_t Dim () const noexcept {
+    return kd_key_traits<Key>::dimension != 0 ? kd_key_traits<Key>::dimension : m_dim;
+  }
+
+  std::string Path (const std::string &name) const {
+    return m_directory + "/" + name;
+  }
+
+  // keys of a run that are built in memory at once
+  size_t capacity (const external_kd_tree_options&) const;
+  void buildRun (const std::string&, const std::uint64_t&, const size_t&, const bool&,
+                 const external_kd_tree_options&);
+  void sampleRun (const std::string&, const std::uint64_t&, const external_kd_tree_options&,
+                  std::vector<subkey_type>&);
+  void splitSample (const std::vector<subkey_type>&, index_type*, index_type*,
+                    const size_t&, const size_t&, std::vector<split_node>&, index_type&);
+  void partitionRun (const std::string&, const std::vector<split_node>&,
+                     const std::vector<std::string>&, std::vector<std::uint64_t>&,
+                     const external_kd_tree_options&);
+  void splitOffKey (const std::string&, const std::uint64_t&, const size_t&, const bool&,
+                    const std::vector<subkey_type>&, const external_kd_tree_options&);
+  void emitSplits (const std::vector<split_node>&, const index_type&,
+                   const std::vector<std::string>&, const std::vector<std::uint64_t>&,
+                   const external_kd_tree_options&);
+  void buildSubtree (const std::string&, const external_kd_tree_options&);
+  void writeIndex () const;
+  template<class Function>
+  static void readRecords (const std::string&, const size_t&, Function);
+
+  std::shared_ptr<const tree_type> Subtree (const index_type&) const;
+  bool Overlaps (const index_type&, const std::vector<std::pair<subkey_type, subkey_type>>&) const;
+  template<class Container, class Function>
+  void ForEachSubtree (const Container&, Function) const;
+
+  // used by open
+  external_kd_tree () : m_dim(0), m_maxOpen(1) {}
+
+public:
+
+  /**
+   * Builds the tree of the kd_record<Key, T>s in the file input into
+   * directory (see above); the input is only read
+   * Throws std::runtime_error if a file can't be read or written
+   */
+  external_kd_tree (const std::string &input, const std::string &directory, const size_t &dim,
+                    const external_kd_tree_options &options = external_kd_tree_options());
+
+  external_kd_tree (external_kd_tree&&) = default;
+
+  /**
+   * Reads the index of a tree built into directory; the subtrees are opened
+   * (with kd_tree::open, and verify) when queries first reach them
+   */
+  static external_kd_tree open (const std::string &directory, const bool &verify = true,
+                                const size_t &max_open = external_kd_tree_options().max_open);
+
+  size_type size () const noexcept {
+    return m_size;
+  }
+
+  bool empty () const noexcept {
+    return m_size == 0;
+  }
+
+  // number of subtrees, and of those mapped at the moment
+  size_type subtrees () const noexcept {
+    return m_counts.size();
+  }
+
+  size_type resident () const;
+
+  /**
+   * Same box queries as kd_tree; the pairs passed to f are only valid during
+   * the call (their subtree may be unmapped afterwards)
+   */
+  template<class Container, class Function>
+  void for_each_in (const Container&, Function) const;
+
+  template<class Function>
+  void for_each_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l, Function f) const
+  {this->for_each_in<decltype(l), Function>(l, f);}
+
+  template<class Container>
+  size_type count (const Container&) const;
+
+  size_type count (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->count<decltype(l)>(l);}
+
+  template<class Container>
+  bool any_in (const Container&) const;
+
+  bool any_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->any_in<decltype(l)>(l);}
+};
+}
+
+#include "external_kd_tree.icc"
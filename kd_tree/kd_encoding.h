@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+namespace Analysis {
+
+/**
+ * Order-preserving codes for coordinates of different types
+ * Numbers of any arithmetic type and strings are mapped to unsigned 64-bit
+ * codes that sort like the values, so that keys with mixed coordinates can be
+ * stored as plain integers (e.g. in a fixed_kd_tree<kd_code, D, T>) and the
+ * tree builds and queries without calling a comparison object for every
+ * coordinate
+ * Query bounds are encoded the same way, and the codes of the keys found
+ * decoded back
+ * Codes of different types don't compare meaningfully: a coordinate that
+ * mixes numeric types should encode all of them as double
+ */
+using kd_code = std::uint64_t;
+
+namespace kd_tree_internal {
+
+constexpr kd_code code_sign = static_cast<kd_code>(1) << 63;
+
+} // kd_tree_internal
+
+
+/**
+ * Signed integers are offset so that the most negative value gets code 0
+ */
+template<class T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, kd_code>::type
+kd_encode (const T &value)
+{
+  return static_cast<kd_code>(static_cast<std::int64_t>(value)) ^ kd_tree_internal::code_sign;
+}
+
+template<class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, kd_code>::type
+kd_encode (const T &value)
+{
+  return static_cast<kd_code>(value);
+}
+
+/**
+ * Floating-point values are encoded through the bits of the double: positive
+ * values get the sign bit set and negative ones all bits flipped, so that the
+ * codes sort like the values
+ * -0 and +0 get the same code, and NaNs the largest one
+ */
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, kd_code>::type
+kd_encode (const T &value)
+{
+  double d = static_cast<double>(value);
+  if (d != d) return std::numeric_limits<kd_code>::max();
+  if (d == 0) d = 0;
+
+  kd_code bits;
+  std::memcpy(&bits, &d, sizeof(bits));
+  return (bits & kd_tree_internal::code_sign) ? ~bits : bits | kd_tree_internal::code_sign;
+}
+
+
+template<class T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, T>::type
+kd_decode (const kd_code &code)
+{
+  return static_cast<T>(static_cast<std::int64_t>(code ^ kd_tree_internal::code_sign));
+}
+
+template<class T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, T>::type
+kd_decode (const kd_code &code)
+{
+  return static_cast<T>(code);
+}
+
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, T>::type
+kd_decode (const kd_code &code)
+{
+  if (code == std::numeric_limits<kd_code>::max()) return std::numeric_limits<T>::quiet_NaN();
+
+  kd_code bits = (code & kd_tree_internal::code_sign) ? code ^ kd_tree_internal::code_sign : ~code;
+  double  d;
+  std::memcpy(&d, &bits, sizeof(d));
+  return static_cast<T>(d);
+}
+
+
+/**
+ * Code of the first 8 bytes of a string, big-endian (shorter strings are
+ * padded with zero bytes), for strings that aren't known in advance
+ * s <= t implies code(s) <= code(t), but strings with a common 8-byte prefix
+ * share a code, so a box of prefix codes may also hold keys whose strings are
+ * just outside of the bounds (they have to be checked on the strings)
+ */
+inline kd_code
+kd_prefix_code (const std::string &s)
+{
+  kd_code code = 0;
+  for (std::size_t i = 0; i < 8; ++i)
+    code = code << 8 | (i < s.size() ? static_cast<unsigned char>(s[i]) : 0);
+  return code;
+}
+
+
+/**
+ * Dictionary codes for strings: the rank (from 1) of a string among the
+ * distinct strings the dictionary was built from, so that the codes sort like
+ * the strings and decode exactly
+ * Query bounds need not be in the dictionary: [lower(lo), upper(hi)] holds
+ * the codes of exactly the strings in [lo, hi] (and is empty, with
+ * lower > upper, if there are none)
+ */
+class kd_string_codes {
+  std::vector<std::string> m_strings;  // sorted, distinct
+
+public:
+
+  kd_string_codes () = default;
+
+  /**
+   * Takes input iterators to the strings (with repetitions) to encode
+   */
+  template<class InputIterator>
+  kd_string_codes (InputIterator first, InputIterator last) : m_strings(first, last)
+  {
+    std::sort(m_strings.begin(), m_strings.end());
+    m_strings.erase(std::unique(m_strings.begin(), m_strings.end()), m_strings.end());
+  }
+
+  std::size_t size () const noexcept {
+    return m_strings.size();
+  }
+
+  /**
+   * Throws std::out_of_range for strings that are not in the dictionary
+   */
+  kd_code encode (const std::string &s) const
+  {
+    auto it = std::lower_bound(m_strings.begin(), m_strings.end(), s);
+    if (it == m_strings.end() || *it != s) throw std::out_of_range("kd_tree: string not in the dictionary");
+    return static_cast<kd_code>(it - m_strings.begin()) + 1;
+  }
+
+  // code of the first string >= s
+  kd_code lower (const std::string &s) const {
+    return static_cast<kd_code>(std::lower_bound(m_strings.begin(), m_strings.end(), s) - m_strings.begin()) + 1;
+  }
+
+  // code of the last string <= s (0 if there is none)
+  kd_code upper (const std::string &s) const {
+    return static_cast<kd_code>(std::upper_bound(m_strings.begin(), m_strings.end(), s) - m_strings.begin());
+  }
+
+  const std::string &decode (const kd_code &code) const
+  {
+    if (code == 0 || code > m_strings.size()) throw std::out_of_range("kd_tree: no string with this code");
+    return m_strings[code - 1];
+  }
+};
+
+}
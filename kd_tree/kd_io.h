@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <limits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define KD_TREE_HAS_MMAP 1
+#endif
+
+namespace Analysis {
+namespace kd_tree_internal {
+
+/**
+ * Header of a saved tree
+ * The file holds the header followed by the node array, the key-value pairs,
+ * the leaf coordinates and the (optional) bounding boxes exactly as they are
+ * laid out in memory, each
+ * section starting at a multiple of file_alignment; nodes refer to each other
+ * and to the pairs by index only, so the sections can be used in place
+ * wherever the file is mapped
+ * Sizes and the byte order of the writer are recorded so that files from an
+ * incompatible build or type are rejected instead of misread
+ */
+struct kd_file_header {
+  char          magic[8];
+  std::uint32_t version;
+  std::uint32_t byte_order;
+  std::uint64_t node_size, value_size, key_size, stored_size, subkey_size, subkey_kind;
+  std::uint64_t dim, leaf_size, height;
+  std::uint64_t node_count, value_count, coord_count, bound_count;
+  std::uint64_t node_offset, value_offset, coord_offset, bound_offset, file_size;
+  std::uint64_t payload_checksum;
+  std::uint64_t header_checksum;  // of all of the above
+};
+
+constexpr char          file_magic[8]  = { 'k', 'd', '-', 't', 'r', 'e', 'e', '\0' };
+constexpr std::uint32_t file_version   = 2;
+constexpr std::uint32_t file_byteorder = 0x01020304;
+constexpr std::uint64_t file_alignment = 64;
+
+// distinguishes coordinate types of the same size (e.g. float and int)
+template<class S>
+constexpr std::uint64_t
+subkey_kind ()
+{
+  return static_cast<std::uint64_t>(std::numeric_limits<S>::is_integer) |
+         static_cast<std::uint64_t>(std::numeric_limits<S>::is_signed) << 1 |
+         static_cast<std::uint64_t>(std::numeric_limits<S>::is_iec559) << 2;
+}
+
+inline std::uint64_t
+file_align (const std::uint64_t &offset)
+{
+  return (offset + file_alignment - 1) / file_alignment * file_alignment;
+}
+
+
+/**
+ * 64-bit checksum of a block of bytes, processed a word at a time, that can
+ * be chained over several blocks through seed
+ */
+inline std::uint64_t
+checksum (const void *data, const std::size_t &bytes, std::uint64_t seed = 0x9e3779b97f4a7c15ull)
+{
+  const auto   *p = static_cast<const unsigned char*>(data);
+  std::uint64_t h = seed ^ (bytes * 0xff51afd7ed558ccdull);
+  std::size_t   i = 0;
+
+  for (; i + 8 <= bytes; i += 8) {
+    std::uint64_t w;
+    std::memcpy(&w, p + i, 8);
+    h ^= w * 0x87c37b91114253d5ull;
+    h  = ((h << 31) | (h >> 33)) * 0x4cf5ad432745937full;
+  }
+  for (; i < bytes; ++i) h = (h ^ p[i]) * 0x100000001b3ull;
+
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  return h ^ (h >> 33);
+}
+
+
+/**
+ * Read-only view of a whole file: a shared memory mapping where mmap is
+ * available, otherwise a copy of the file on the heap
+ */
+class kd_mapping {
+  const char *m_data { nullptr };
+  std::size_t m_size { 0 };
+#ifndef KD_TREE_HAS_MMAP
+  std::vector<std::max_align_t> m_buffer;
+#endif
+
+public:
+  explicit kd_mapping (const std::string &path)
+  {
+#ifdef KD_TREE_HAS_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("kd_tree: can't open " + path);
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("kd_tree: can't stat " + path);
+    }
+    m_size = static_cast<std::size_t>(st.st_size);
+    if (m_size != 0) {
+      void *p = ::mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("kd_tree: can't map " + path);
+      }
+      m_data = static_cast<const char*>(p);
+    }
+    ::close(fd);
+#else
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("kd_tree: can't open " + path);
+    m_size = static_cast<std::size_t>(in.tellg());
+    m_buffer.resize((m_size + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char*>(m_buffer.data()), m_size))
+      throw std::runtime_error("kd_tree: can't read " + path);
+    m_data = reinterpret_cast<const char*>(m_buffer.data());
+#endif
+  }
+
+  kd_mapping (const kd_mapping&) = delete;
+  kd_mapping &operator= (const kd_mapping&) = delete;
+
+  ~kd_mapping ()
+  {
+#ifdef KD_TREE_HAS_MMAP
+    if (m_data != nullptr) ::munmap(const_cast<char*>(m_data), m_size);
+#endif
+  }
+
+  const char *data () const noexcept {
+    return m_data;
+  }
+
+  std::size_t size () const noexcept {
+    return m_size;
+  }
+};
+
+} // kd_tree_internal
+}
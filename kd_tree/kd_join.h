@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <exception>
+#include <type_traits>
+#include <stdexcept>
+#include <initializer_list>
+
+#include "kd_tree.h"
+
+namespace Analysis {
+namespace kd_tree_internal {
+
+/**
+ * x - t and x + t for a tolerance t >= 0, clamped to the range of integer
+ * coordinates instead of wrapping around (or overflowing, for signed ones)
+ */
+template<class T>
+typename std::enable_if<std::is_integral<T>::value, T>::type
+shift_down (const T &x, const T &t)
+{
+  return x < static_cast<T>(std::numeric_limits<T>::min() + t) ? std::numeric_limits<T>::min() : static_cast<T>(x - t);
+}
+
+template<class T>
+typename std::enable_if<std::is_integral<T>::value, T>::type
+shift_up (const T &x, const T &t)
+{
+  return static_cast<T>(std::numeric_limits<T>::max() - t) < x ? std::numeric_limits<T>::max() : static_cast<T>(x + t);
+}
+
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, T>::type
+shift_down (const T &x, const T &t)
+{
+  return static_cast<T>(x - t);
+}
+
+template<class T>
+typename std::enable_if<std::is_floating_point<T>::value, T>::type
+shift_up (const T &x, const T &t)
+{
+  return static_cast<T>(x + t);
+}
+
+
+/**
+ * Walks two trees together, over pairs of nodes (one of each tree)
+ * A pair is dropped when the bounding boxes of the nodes, the first one grown
+ * by the tolerance, don't overlap, and all of its key pairs are reported
+ * without testing them when every key of one node is within the tolerance of
+ * every key of the other. Otherwise the second node is narrowed down to one
+ * child while the first one lies on one side of its split, and the first one
+ * is split when it straddles it. Once the first node is a leaf, each of its
+ * keys is looked up in the subtree of the second one
+ */
+template<class TreeA, class TreeB, class Function>
+class kd_join {
+  using subkey_type = typename TreeA::subkey_type;
+  using node_pair   = std::pair<index_type, index_type>;
+
+  const TreeA &m_a;
+  const TreeB &m_b;
+  Function    &m_f;
+  size_t       m_dim;
+  bool         m_none { false };  // a tolerance is negative: no pair matches
+  std::vector<subkey_type> m_tolerance;
+  std::vector<subkey_type> m_boundsA, m_boundsB;  // when the trees store none
+  const subkey_type       *m_loA { nullptr }, *m_loB { nullptr };
+
+  overlap Relate (const node_pair&) const;
+  bool Expand (const node_pair&, std::vector<node_pair>&) const;
+  void JoinLeaf (const node_pair&, std::vector<subkey_type>&) const;
+  void JoinAll (const node_pair&) const;
+  void Walk (const node_pair&) const;
+
+public:
+
+  template<class Container>
+  kd_join (const TreeA&, const TreeB&, const Container&, Function&);
+
+  void run (const size_t &threads);
+};
+
+} // kd_tree_internal
+
+
+/**
+ * Calls f(a, b) for every pair of a key-value pair a of treeA and a key-value
+ * pair b of treeB whose keys are within tolerance of each other in every
+ * coordinate (|a_d - b_d| <= tolerance_d, so b lies in the box of half-widths
+ * tolerance around a)
+ * Container should be iterable and contain the tolerance of each coordinate
+ * The trees are walked together (see kd_tree_internal::kd_join) instead of
+ * querying treeB once per key of treeA; the walk needs the bounding box of
+ * every node, which trees built without kd_tree_options::bounding_boxes get
+ * for the duration of the call
+ * With threads > 1 the pairs of nodes are split between threads (f is then
+ * called concurrently)
+ * Only for arithmetic coordinates, compared with the built-in operators; the
+ * trees must have the same dimension. The boxes around integer keys are
+ * clamped to the range of the type
+ */
+template<class KeyA, class TA, class KeyB, class TB,
+         class Compare, class Equate, class AllocA, class AllocB,
+         class Container, class Function>
+void
+join (const kd_tree<KeyA, TA, Compare, Equate, AllocA> &treeA,
+      const kd_tree<KeyB, TB, Compare, Equate, AllocB> &treeB,
+      const Container &tolerance, Function f, const size_t &threads = 1);
+
+template<class KeyA, class TA, class KeyB, class TB,
+         class Compare, class Equate, class AllocA, class AllocB,
+         class Function>
+void
+join (const kd_tree<KeyA, TA, Compare, Equate, AllocA> &treeA,
+      const kd_tree<KeyB, TB, Compare, Equate, AllocB> &treeB,
+      std::initializer_list<typename kd_key_traits<KeyA>::subkey_type> tolerance, Function f,
+      const size_t &threads = 1)
+{
+  join<KeyA, TA, KeyB, TB, Compare, Equate, AllocA, AllocB, decltype(tolerance), Function>
+    (treeA, treeB, tolerance, f, threads);
+}
+}
+
+#include "kd_join.icc"
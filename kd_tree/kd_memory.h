@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <memory>
+#include <algorithm>
+
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#define KD_TREE_HAS_PMR 1
+#endif
+#endif
+
+namespace Analysis {
+
+/**
+ * Polymorphic source of raw memory for the storage of a kd_tree (modelled on
+ * std::pmr::memory_resource, which is not available in C++11)
+ */
+class kd_memory_resource {
+public:
+  virtual ~kd_memory_resource () {}
+
+  void *allocate (std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) {
+    return this->do_allocate(bytes, alignment);
+  }
+
+  void deallocate (void *p, std::size_t bytes, std::size_t alignment = alignof(std::max_align_t)) {
+    this->do_deallocate(p, bytes, alignment);
+  }
+
+  bool is_equal (const kd_memory_resource &other) const noexcept {
+    return this->do_is_equal(other);
+  }
+
+private:
+  virtual void *do_allocate (std::size_t, std::size_t) = 0;
+  virtual void do_deallocate (void*, std::size_t, std::size_t) = 0;
+  virtual bool do_is_equal (const kd_memory_resource &other) const noexcept {
+    return this == &other;
+  }
+};
+
+
+namespace kd_tree_internal {
+class new_delete_resource : public kd_memory_resource {
+  void *do_allocate (std::size_t bytes, std::size_t) override {
+    return ::operator new(bytes);
+  }
+
+  void do_deallocate (void *p, std::size_t, std::size_t) override {
+    ::operator delete(p);
+  }
+};
+} // kd_tree_internal
+
+
+/**
+ * Resource that forwards to global operator new/delete (the default)
+ */
+inline kd_memory_resource *
+kd_new_delete_resource () noexcept
+{
+  static kd_tree_internal::new_delete_resource resource;
+  return &resource;
+}
+
+
+/**
+ * Monotonic arena: memory is carved out of large blocks taken from an upstream
+ * resource, deallocate does nothing and all blocks are returned at once by
+ * release() or the destructor, in O(number of blocks)
+ * The first block has the size passed to the constructor (e.g. from
+ * kd_tree::storage_bytes), every further block is twice as large as the last
+ * Not thread-safe
+ */
+class kd_arena_resource : public kd_memory_resource {
+  struct block_header {
+    block_header *next;
+    std::size_t   bytes;
+  };
+
+  kd_memory_resource *m_upstream;
+  block_header *m_blocks { nullptr };
+  char         *m_current { nullptr };
+  std::size_t   m_left { 0 };
+  std::size_t   m_nextSize;
+
+  static std::size_t header_size () noexcept {
+    return (sizeof(block_header) + alignof(std::max_align_t) - 1) /
+           alignof(std::max_align_t) * alignof(std::max_align_t);
+  }
+
+  void *do_allocate (std::size_t bytes, std::size_t alignment) override {
+    auto padding = static_cast<std::size_t>(-reinterpret_cast<std::uintptr_t>(m_current) & (alignment - 1));
+
+    if (m_current == nullptr || padding + bytes > m_left) {
+      auto size  = std::max(m_nextSize, bytes + alignment) + header_size();
+      auto block = static_cast<block_header*>(m_upstream->allocate(size));
+
+      block->next  = m_blocks;
+      block->bytes = size;
+      m_blocks     = block;
+      m_current    = reinterpret_cast<char*>(block) + header_size();
+      m_left       = size - header_size();
+      m_nextSize   = 2 * (size - header_size());
+      padding      = static_cast<std::size_t>(-reinterpret_cast<std::uintptr_t>(m_current) & (alignment - 1));
+    }
+
+    auto p = m_current + padding;
+    m_current += padding + bytes;
+    m_left    -= padding + bytes;
+    return p;
+  }
+
+  void do_deallocate (void*, std::size_t, std::size_t) override {}
+
+public:
+  explicit kd_arena_resource (std::size_t initial_bytes = 1 << 16,
+                              kd_memory_resource *upstream = kd_new_delete_resource()) :
+    m_upstream(upstream), m_nextSize(std::max<std::size_t>(initial_bytes, 1))
+  {}
+
+  kd_arena_resource (const kd_arena_resource&) = delete;
+  kd_arena_resource &operator= (const kd_arena_resource&) = delete;
+
+  ~kd_arena_resource () {
+    this->release();
+  }
+
+  /**
+   * Returns all blocks to the upstream resource (everything allocated from
+   * the arena becomes invalid)
+   */
+  void release () noexcept {
+    while (m_blocks != nullptr) {
+      auto next = m_blocks->next;
+      m_upstream->deallocate(m_blocks, m_blocks->bytes);
+      m_blocks = next;
+    }
+    m_current = nullptr;
+    m_left    = 0;
+  }
+
+  kd_memory_resource *upstream_resource () const noexcept {
+    return m_upstream;
+  }
+};
+
+
+/**
+ * Resource that takes its blocks from any standard allocator (e.g. the Alloc
+ * of a kd_tree), to be used as the upstream of an arena
+ */
+template<class Alloc>
+class kd_allocator_resource : public kd_memory_resource {
+  using byte_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<std::max_align_t>;
+
+  byte_alloc m_alloc;
+
+  static std::size_t units (const std::size_t &bytes) noexcept {
+    return (bytes + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t);
+  }
+
+  void *do_allocate (std::size_t bytes, std::size_t) override {
+    return std::allocator_traits<byte_alloc>::allocate(m_alloc, units(bytes));
+  }
+
+  void do_deallocate (void *p, std::size_t bytes, std::size_t) override {
+    std::allocator_traits<byte_alloc>::deallocate(m_alloc, static_cast<std::max_align_t*>(p), units(bytes));
+  }
+
+public:
+  explicit kd_allocator_resource (const Alloc &alloc = Alloc()) : m_alloc(alloc) {}
+};
+
+
+#ifdef KD_TREE_HAS_PMR
+/**
+ * Forwards to a std::pmr::memory_resource (C++17)
+ */
+class kd_pmr_resource : public kd_memory_resource {
+  std::pmr::memory_resource *m_resource;
+
+  void *do_allocate (std::size_t bytes, std::size_t alignment) override {
+    return m_resource->allocate(bytes, alignment);
+  }
+
+  void do_deallocate (void *p, std::size_t bytes, std::size_t alignment) override {
+    m_resource->deallocate(p, bytes, alignment);
+  }
+
+public:
+  explicit kd_pmr_resource (std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
+    m_resource(resource)
+  {}
+};
+#endif
+
+
+/**
+ * Allocator that takes its memory from a kd_memory_resource, for use as the
+ * Alloc of a kd_tree (the resource must outlive the tree)
+ */
+template<class T>
+class kd_polymorphic_allocator {
+  template<class> friend class kd_polymorphic_allocator;
+
+  kd_memory_resource *m_resource;
+
+public:
+  using value_type = T;
+
+  kd_polymorphic_allocator () noexcept : m_resource(kd_new_delete_resource()) {}
+  kd_polymorphic_allocator (kd_memory_resource *resource) noexcept : m_resource(resource) {}
+  template<class U>
+  kd_polymorphic_allocator (const kd_polymorphic_allocator<U> &other) noexcept :
+    m_resource(other.m_resource)
+  {}
+
+  T *allocate (std::size_t n) {
+    if (n > static_cast<std::size_t>(-1) / sizeof(T)) throw std::bad_alloc();
+    return static_cast<T*>(m_resource->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate (T *p, std::size_t n) {
+    m_resource->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  kd_memory_resource *resource () const noexcept {
+    return m_resource;
+  }
+
+  // copies of a container keep using the default resource, like std::pmr
+  kd_polymorphic_allocator select_on_container_copy_construction () const {
+    return kd_polymorphic_allocator();
+  }
+
+  template<class U>
+  bool operator== (const kd_polymorphic_allocator<U> &other) const noexcept {
+    return m_resource == other.m_resource || m_resource->is_equal(*other.m_resource);
+  }
+
+  template<class U>
+  bool operator!= (const kd_polymorphic_allocator<U> &other) const noexcept {
+    return !(*this == other);
+  }
+};
+
+}
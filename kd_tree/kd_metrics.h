@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+namespace Analysis {
+namespace kd_metric {
+
+/**
+ * Metrics for nearest-neighbour searches
+ * Searches work on "reduced" distances that are cheaper to compute than the
+ * real ones but sort the same way (e.g. squared Euclidean distances)
+ * term maps a coordinate difference to its contribution, combine adds a
+ * contribution to a reduced distance and update replaces one contribution
+ * with another (the new one is never smaller than the old one)
+ * reduce/distance convert real distances to reduced ones and back
+ */
+struct L2 {
+  static double term (const double &diff) {return diff * diff;}
+  static double combine (const double &acc, const double &t) {return acc + t;}
+  static double update (const double &acc, const double &old, const double &t) {return acc - old + t;}
+  static double reduce (const double &d) {return d * d;}
+  static double distance (const double &r) {return std::sqrt(r);}
+};
+
+struct L1 {
+  static double term (const double &diff) {return std::abs(diff);}
+  static double combine (const double &acc, const double &t) {return acc + t;}
+  static double update (const double &acc, const double &old, const double &t) {return acc - old + t;}
+  static double reduce (const double &d) {return d;}
+  static double distance (const double &r) {return r;}
+};
+
+struct Linf {
+  static double term (const double &diff) {return std::abs(diff);}
+  static double combine (const double &acc, const double &t) {return std::max(acc, t);}
+  static double update (const double &acc, const double&, const double &t) {return std::max(acc, t);}
+  static double reduce (const double &d) {return d;}
+  static double distance (const double &r) {return r;}
+};
+
+/**
+ * Squared Euclidean distances, for radius queries whose radius is already
+ * squared (the reduced and the real distances are the same)
+ */
+struct L2squared {
+  static double term (const double &diff) {return diff * diff;}
+  static double combine (const double &acc, const double &t) {return acc + t;}
+  static double update (const double &acc, const double &old, const double &t) {return acc - old + t;}
+  static double reduce (const double &d) {return d;}
+  static double distance (const double &r) {return r;}
+};
+
+} // kd_metric
+}
@@ -0,0 +1,324 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <limits>
+
+#include "kd_metrics.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace Analysis {
+namespace kd_tree_internal {
+
+/**
+ * Kernels for testing a block of (at most 64) consecutive coordinates against
+ * one min/max pair
+ * Bit i of the result is set if lo <= c[i] <= hi
+ */
+template<class S>
+inline std::uint64_t
+box_mask (const S *c, const std::size_t &count, const S &lo, const S &hi)
+{
+  std::uint64_t mask = 0;
+  for (std::size_t i = 0; i < count; ++i)
+    mask |= static_cast<std::uint64_t>((lo <= c[i]) & (c[i] <= hi)) << i;
+  return mask;
+}
+
+inline std::uint64_t
+box_mask (const double *c, const std::size_t &count, const double &lo, const double &hi)
+{
+  std::uint64_t mask = 0;
+  std::size_t   i    = 0;
+#if defined(__AVX__)
+  const __m256d vlo = _mm256_set1_pd(lo),
+                vhi = _mm256_set1_pd(hi);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d v  = _mm256_loadu_pd(c + i);
+    const __m256d in = _mm256_and_pd(_mm256_cmp_pd(vlo, v, _CMP_LE_OQ),
+                                     _mm256_cmp_pd(v, vhi, _CMP_LE_OQ));
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_pd(in)) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128d vlo = _mm_set1_pd(lo),
+                vhi = _mm_set1_pd(hi);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d v  = _mm_loadu_pd(c + i);
+    const __m128d in = _mm_and_pd(_mm_cmple_pd(vlo, v), _mm_cmple_pd(v, vhi));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_pd(in)) << i;
+  }
+#endif
+  for (; i < count; ++i)
+    mask |= static_cast<std::uint64_t>((lo <= c[i]) & (c[i] <= hi)) << i;
+  return mask;
+}
+
+inline std::uint64_t
+box_mask (const float *c, const std::size_t &count, const float &lo, const float &hi)
+{
+  std::uint64_t mask = 0;
+  std::size_t   i    = 0;
+#if defined(__AVX__)
+  const __m256 vlo = _mm256_set1_ps(lo),
+               vhi = _mm256_set1_ps(hi);
+  for (; i + 8 <= count; i += 8) {
+    const __m256 v  = _mm256_loadu_ps(c + i);
+    const __m256 in = _mm256_and_ps(_mm256_cmp_ps(vlo, v, _CMP_LE_OQ),
+                                    _mm256_cmp_ps(v, vhi, _CMP_LE_OQ));
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_ps(in)) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128 vlo = _mm_set1_ps(lo),
+               vhi = _mm_set1_ps(hi);
+  for (; i + 4 <= count; i += 4) {
+    const __m128 v  = _mm_loadu_ps(c + i);
+    const __m128 in = _mm_and_ps(_mm_cmple_ps(vlo, v), _mm_cmple_ps(v, vhi));
+    mask |= static_cast<std::uint64_t>(_mm_movemask_ps(in)) << i;
+  }
+#endif
+  for (; i < count; ++i)
+    mask |= static_cast<std::uint64_t>((lo <= c[i]) & (c[i] <= hi)) << i;
+  return mask;
+}
+
+// unsigned 64-bit coordinates (e.g. kd_code); compared as signed integers
+// with the sign bit flipped, as AVX2 has no unsigned 64-bit comparison
+inline std::uint64_t
+box_mask (const std::uint64_t *c, const std::size_t &count, const std::uint64_t &lo, const std::uint64_t &hi)
+{
+  std::uint64_t mask = 0;
+  std::size_t   i    = 0;
+#if defined(__AVX2__)
+  const __m256i flip = _mm256_set1_epi64x(std::numeric_limits<long long>::min()),
+                vlo  = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(lo)), flip),
+                vhi  = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(hi)), flip);
+  for (; i + 4 <= count; i += 4) {
+    const __m256i v   = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(c + i)), flip);
+    const __m256i out = _mm256_or_si256(_mm256_cmpgt_epi64(vlo, v), _mm256_cmpgt_epi64(v, vhi));
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_pd(_mm256_castsi256_pd(out)) ^ 0xf) << i;
+  }
+#endif
+  for (; i < count; ++i)
+    mask |= static_cast<std::uint64_t>((lo <= c[i]) & (c[i] <= hi)) << i;
+  return mask;
+}
+
+
+/**
+ * Index of the lowest set bit of a non-zero mask
+ */
+inline unsigned
+first_set_bit (const std::uint64_t &mask)
+{
+#if defined(__GNUC__)
+  return static_cast<unsigned>(__builtin_ctzll(mask));
+#else
+  unsigned bit = 0;
+  while (!((mask >> bit) & 1)) ++bit;
+  return bit;
+#endif
+}
+
+
+/**
+ * Number of set bits of a mask
+ */
+inline unsigned
+count_set_bits (const std::uint64_t &mask)
+{
+#if defined(__GNUC__)
+  return static_cast<unsigned>(__builtin_popcountll(mask));
+#else
+  unsigned bits = 0;
+  for (auto m = mask; m; m &= m - 1) ++bits;
+  return bits;
+#endif
+}
+
+
+/**
+ * Picks the vectorized kernels when the tree orders its coordinates with the
+ * built-in operators, and otherwise calls Compare/Equate for every coordinate
+ */
+template<class S, class Compare, class Equate, class Enable = void>
+struct box_kernel {
+  static std::uint64_t
+  contains (const S *c, const std::size_t &count, const S &lo, const S &hi,
+            const Compare &comp, const Equate &equate)
+  {
+    std::uint64_t mask = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+      if ((comp(lo, c[i]) || equate(lo, c[i])) &&
+          (comp(c[i], hi) || equate(c[i], hi)))
+        mask |= static_cast<std::uint64_t>(1) << i;
+    }
+    return mask;
+  }
+};
+
+template<class S>
+struct box_kernel<S, std::less<S>, std::equal_to<S>,
+                  typename std::enable_if<std::is_arithmetic<S>::value>::type> {
+  static std::uint64_t
+  contains (const S *c, const std::size_t &count, const S &lo, const S &hi,
+            const std::less<S>&, const std::equal_to<S>&)
+  {
+    return box_mask(c, count, lo, hi);
+  }
+};
+
+
+/**
+ * Kernels for adding one coordinate's contribution to the (reduced) distances
+ * of a block of consecutive keys to a point: acc[i] is combined with the term
+ * of x - c[i]
+ * add_squares sums squared differences, add_absolute absolute ones and
+ * max_absolute keeps the largest absolute difference
+ */
+inline void
+add_squares (double *acc, const double *c, const std::size_t &count, const double &x)
+{
+  std::size_t i = 0;
+#if defined(__AVX__)
+  const __m256d vx = _mm256_set1_pd(x);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d diff = _mm256_sub_pd(vx, _mm256_loadu_pd(c + i));
+    _mm256_storeu_pd(acc + i, _mm256_add_pd(_mm256_loadu_pd(acc + i), _mm256_mul_pd(diff, diff)));
+  }
+#elif defined(__SSE2__)
+  const __m128d vx = _mm_set1_pd(x);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d diff = _mm_sub_pd(vx, _mm_loadu_pd(c + i));
+    _mm_storeu_pd(acc + i, _mm_add_pd(_mm_loadu_pd(acc + i), _mm_mul_pd(diff, diff)));
+  }
+#endif
+  for (; i < count; ++i) acc[i] += (x - c[i]) * (x - c[i]);
+}
+
+inline void
+add_absolute (double *acc, const double *c, const std::size_t &count, const double &x)
+{
+  std::size_t i = 0;
+#if defined(__AVX__)
+  const __m256d vx   = _mm256_set1_pd(x),
+                sign = _mm256_set1_pd(-0.);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(vx, _mm256_loadu_pd(c + i)));
+    _mm256_storeu_pd(acc + i, _mm256_add_pd(_mm256_loadu_pd(acc + i), diff));
+  }
+#elif defined(__SSE2__)
+  const __m128d vx   = _mm_set1_pd(x),
+                sign = _mm_set1_pd(-0.);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d diff = _mm_andnot_pd(sign, _mm_sub_pd(vx, _mm_loadu_pd(c + i)));
+    _mm_storeu_pd(acc + i, _mm_add_pd(_mm_loadu_pd(acc + i), diff));
+  }
+#endif
+  for (; i < count; ++i) acc[i] += x < c[i] ? c[i] - x : x - c[i];
+}
+
+inline void
+max_absolute (double *acc, const double *c, const std::size_t &count, const double &x)
+{
+  std::size_t i = 0;
+#if defined(__AVX__)
+  const __m256d vx   = _mm256_set1_pd(x),
+                sign = _mm256_set1_pd(-0.);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(vx, _mm256_loadu_pd(c + i)));
+    _mm256_storeu_pd(acc + i, _mm256_max_pd(_mm256_loadu_pd(acc + i), diff));
+  }
+#elif defined(__SSE2__)
+  const __m128d vx   = _mm_set1_pd(x),
+                sign = _mm_set1_pd(-0.);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d diff = _mm_andnot_pd(sign, _mm_sub_pd(vx, _mm_loadu_pd(c + i)));
+    _mm_storeu_pd(acc + i, _mm_max_pd(_mm_loadu_pd(acc + i), diff));
+  }
+#endif
+  for (; i < count; ++i) {
+    const double diff = x < c[i] ? c[i] - x : x - c[i];
+    if (acc[i] < diff) acc[i] = diff;
+  }
+}
+
+
+/**
+ * Bit i of the result is set if acc[i] <= limit (for at most 64 distances)
+ */
+inline std::uint64_t
+below_mask (const double *acc, const std::size_t &count, const double &limit)
+{
+  std::uint64_t mask = 0;
+  std::size_t   i    = 0;
+#if defined(__AVX__)
+  const __m256d vlimit = _mm256_set1_pd(limit);
+  for (; i + 4 <= count; i += 4) {
+    const __m256d in = _mm256_cmp_pd(_mm256_loadu_pd(acc + i), vlimit, _CMP_LE_OQ);
+    mask |= static_cast<std::uint64_t>(_mm256_movemask_pd(in)) << i;
+  }
+#elif defined(__SSE2__)
+  const __m128d vlimit = _mm_set1_pd(limit);
+  for (; i + 2 <= count; i += 2) {
+    const __m128d in = _mm_cmple_pd(_mm_loadu_pd(acc + i), vlimit);
+    mask |= static_cast<std::uint64_t>(_mm_movemask_pd(in)) << i;
+  }
+#endif
+  for (; i < count; ++i)
+    mask |= static_cast<std::uint64_t>(acc[i] <= limit) << i;
+  return mask;
+}
+
+
+/**
+ * Picks the vectorized distance kernels for double coordinates and the
+ * metrics of kd_metric, and otherwise goes through Metric::term/combine for
+ * every coordinate
+ */
+template<class Metric, class S>
+struct distance_kernel {
+  static void
+  accumulate (double *acc, const S *c, const std::size_t &count, const double &x)
+  {
+    for (std::size_t i = 0; i < count; ++i)
+      acc[i] = Metric::combine(acc[i], Metric::term(x - static_cast<double>(c[i])));
+  }
+};
+
+template<>
+struct distance_kernel<kd_metric::L2, double> {
+  static void
+  accumulate (double *acc, const double *c, const std::size_t &count, const double &x)
+  {add_squares(acc, c, count, x);}
+};
+
+template<>
+struct distance_kernel<kd_metric::L2squared, double> {
+  static void
+  accumulate (double *acc, const double *c, const std::size_t &count, const double &x)
+  {add_squares(acc, c, count, x);}
+};
+
+template<>
+struct distance_kernel<kd_metric::L1, double> {
+  static void
+  accumulate (double *acc, const double *c, const std::size_t &count, const double &x)
+  {add_absolute(acc, c, count, x);}
+};
+
+template<>
+struct distance_kernel<kd_metric::Linf, double> {
+  static void
+  accumulate (double *acc, const double *c, const std::size_t &count, const double &x)
+  {max_absolute(acc, c, count, x);}
+};
+
+} // kd_tree_internal
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+
+namespace Analysis {
+
+/**
+ * Counters of the work done by the queries of the calling thread
+ * They are only kept if KD_TREE_STATS is defined before the library is
+ * included; otherwise the counting compiles to nothing and the counters stay
+ * at zero
+ * nodes_visited    interior nodes and leaves reached by a traversal
+ * leaves_tested    leaves whose keys were compared with the query
+ * keys_tested      keys compared with the query
+ * subtrees_pruned  children (or bounding boxes) skipped as out of reach
+ * subtrees_taken   subtrees taken whole, without testing their keys
+ */
+struct kd_tree_stats {
+  std::uint64_t nodes_visited { 0 };
+  std::uint64_t leaves_tested { 0 };
+  std::uint64_t keys_tested { 0 };
+  std::uint64_t subtrees_pruned { 0 };
+  std::uint64_t subtrees_taken { 0 };
+
+  void reset () {
+    *this = kd_tree_stats();
+  }
+};
+
+#ifdef KD_TREE_STATS
+constexpr bool kd_stats_enabled = true;
+#else
+constexpr bool kd_stats_enabled = false;
+#endif
+
+inline kd_tree_stats &
+kd_stats ()
+{
+  static thread_local kd_tree_stats stats;
+  return stats;
+}
+
+}
+
+#ifdef KD_TREE_STATS
+#define KD_TREE_COUNT(counter, n) (::Analysis::kd_stats().counter += (n))
+#else
+#define KD_TREE_COUNT(counter, n) ((void)0)
+#endif
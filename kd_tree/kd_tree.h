@@ -1,190 +1,539 @@
+#pragma once
+
 #include <functional>
 #include <iterator>
 #include <initializer_list>
 #include <forward_list>
 #include <algorithm>
+#include <vector>
+#include <memory>
+#include <limits>
+#include <stdexcept>
+#include <cstdint>
+#include <array>
+#include <thread>
+#include <exception>
+#include <new>
+#include <type_traits>
+
+#include "kd_simd.h"
+#include "kd_metrics.h"
+#include "kd_memory.h"
+#include "kd_io.h"
+#include "kd_stats.h"
 
 namespace Analysis {
 template<class, class, class,
          class, class> class kd_tree;
 
+/**
+ * Describes how the tree reads the coordinates of a key
+ * By default keys are forward-iterable containers whose dimension is only
+ * known at run time; keys with a dimension fixed at compile time (std::array,
+ * or any point type with a specialization of this template) are indexed
+ * directly and all loops over their coordinates have constant bounds
+ * dimension is 0 for keys whose dimension is only known at run time
+ */
+template<class Key>
+struct kd_key_traits {
+  using subkey_type = typename Key::value_type;
+  static constexpr size_t dimension = 0;
+
+  static const subkey_type& coord (const Key &key, const size_t &i)
+  {
+    // works with containers (for keys) other than vectors
+    auto it = key.begin();
+    std::advance(it, i);
+    return *it;
+  }
+};
+
+template<class S, size_t D>
+struct kd_key_traits<std::array<S, D>> {
+  using subkey_type = S;
+  static constexpr size_t dimension = D;
+
+  static const subkey_type& coord (const std::array<S, D> &key, const size_t &i)
+  {
+    return key[i];
+  }
+};
+
 namespace kd_tree_internal {
-class kd_node_base {
+using index_type = std::uint32_t;
+
+/**
+ * Interior nodes and leaves share one flat record so that the whole tree lives
+ * in a single contiguous array laid out in depth-first (pre-order) order
+ * The left child of an interior node is always the next record in the array,
+ * so only the index of the right child is stored; leaves have no right child
+ * Every subtree covers the contiguous range [begin, end) of the packed values
+ * and, for leaves, of the packed coordinate blocks
+ */
+template<class Key>
+class kd_node {
   template<class, class, class,
            class, class> friend class Analysis::kd_tree;
 
-  bool m_isLeaf;
+  using subkey_type = typename kd_key_traits<Key>::subkey_type;
+
+  subkey_type m_median {};
+  index_type  m_rightChild { 0 };
+  index_type  m_axis { 0 };
+  index_type  m_begin { 0 },
+              m_end { 0 };
 
 public:
 
-  kd_node_base (const bool &isLeaf) : m_isLeaf(isLeaf) {}
-  kd_node_base (const kd_node_base &other) : m_isLeaf(other.m_isLeaf) {}
-  kd_node_base (kd_node_base &&other) : m_isLeaf(std::move(other.m_isLeaf)) {}
+  bool isLeaf () const noexcept {
+    return m_rightChild == 0;
+  }
 
-  virtual ~kd_node_base () {}
+  const subkey_type& GetMedian () const noexcept {
+    return m_median;
+  }
 
-  bool isLeaf () const noexcept {
-    return m_isLeaf;
+  index_type GetAxis () const noexcept {
+    return m_axis;
   }
-};
 
+  // the root is never a child, so the index of a leaf's right child is unused
+  index_type GetLeftChild (const index_type &self) const noexcept {
+    return self + 1;
+  }
 
-template<class Key, class T,
-         class Alloc = std::allocator<std::pair<const Key, const T> > >
-class kd_leaf : public kd_node_base {
-  template<class, class, class,
-           class, class> friend class Analysis::kd_tree;
+  index_type GetRightChild () const noexcept {
+    return m_rightChild;
+  }
 
-  using value_type = std::pair<const Key, const T>;
+  index_type GetBegin () const noexcept {
+    return m_begin;
+  }
 
-  value_type m_value;
+  index_type GetEnd () const noexcept {
+    return m_end;
+  }
+};
+
+
+/**
+ * Iterates over the packed values of a tree, yielding reference_wrappers so
+ * that it can be used the same way as the results of a range query
+ * As with the list of reference_wrappers the tree used to keep, *it is an
+ * lvalue (for (auto &p : tree)) and it->get() works: the reference_wrapper
+ * lives in the iterator, so references to it are only valid until the
+ * iterator is moved or destroyed
+ */
+template<class Iterator>
+class kd_value_iterator {
+  using element_type = typename std::iterator_traits<Iterator>::value_type;
+  using wrapper_type = std::reference_wrapper<const element_type>;
+
+  Iterator m_it;
+  mutable typename std::aligned_storage<sizeof(wrapper_type), alignof(wrapper_type)>::type m_current;
 
 public:
 
-  kd_leaf (const value_type &val) : kd_node_base(true), m_value {val} {}
-  kd_leaf (value_type &&val) : kd_node_base(true), m_value {std::move(val)} {}
-  kd_leaf (const kd_leaf &other) : kd_node_base(true), m_value(other.m_value) {}
-  kd_leaf (kd_leaf &&other) : kd_node_base(true), m_value(std::move(other.m_value)) {}
+  using value_type        = wrapper_type;
+  using reference         = const value_type&;
+  using pointer           = const value_type*;
+  using difference_type   = typename std::iterator_traits<Iterator>::difference_type;
+  using iterator_category = std::forward_iterator_tag;
 
-  virtual ~kd_leaf () {}
+  kd_value_iterator () = default;
+  explicit kd_value_iterator (Iterator it) : m_it(it) {}
 
-  const Key& GetKey () const noexcept {
-    return m_value.first;
-  }
+  reference operator* () const {return *::new (static_cast<void*>(&m_current)) value_type(*m_it);}
+  pointer operator-> () const {return &**this;}
 
-  const T& GetValue () const noexcept {
-    return m_value.second;
-  }
+  kd_value_iterator& operator++ () {++m_it; return *this;}
+  kd_value_iterator operator++ (int) {auto tmp = *this; ++m_it; return tmp;}
 
-  const value_type& GetPair () const noexcept {
-    return m_value;
-  }
+  bool operator== (const kd_value_iterator &other) const {return m_it == other.m_it;}
+  bool operator!= (const kd_value_iterator &other) const {return m_it != other.m_it;}
 };
 
 
-template<class Key, class T,
-         class Alloc = std::allocator<std::pair<const Key, const T> > >
-class kd_node : public kd_node_base {
-  template<class, class, class,
-           class, class> friend class Analysis::kd_tree;
+/**
+ * Read-only window on a contiguous array, either one owned by a tree or a
+ * section of a mapped file
+ */
+template<class T>
+class kd_span {
+  const T *m_data { nullptr };
+  size_t   m_size { 0 };
 
-  using subkey_type = typename Key::value_type;
-  using subkey_alloc = typename Key::allocator_type;
+public:
+
+  kd_span () = default;
+  kd_span (const T *data, const size_t &size) : m_data(data), m_size(size) {}
+
+  const T &operator[] (const size_t &i) const noexcept {return m_data[i];}
+  const T *data () const noexcept {return m_data;}
+  size_t size () const noexcept {return m_size;}
+  bool empty () const noexcept {return m_size == 0;}
+  const T *begin () const noexcept {return m_data;}
+  const T *end () const noexcept {return m_data + m_size;}
+};
 
-  subkey_alloc   m_coordAlloc;
-  subkey_type   *m_median { nullptr };
-  kd_node_base  *m_leftChild { nullptr },
-                *m_rightChild { nullptr };
+
+// how a node's bounding box relates to a query box or ball
+enum class overlap { none, partial, full };
+
+
+/**
+ * Trees are never deeper than max_depth (deeper ranges become oversized
+ * leaves), so a depth-first traversal never has more than max_depth + 1
+ * pending nodes and can use a fixed-size stack
+ */
+constexpr size_t max_depth = 127;
+
+template<class Index>
+class kd_stack {
+  Index  m_data[max_depth + 1];
+  size_t m_size { 0 };
 
 public:
 
-  kd_node () : kd_node_base(false) {}
-  kd_node (const kd_node &other) : kd_node_base(false)
+  bool empty () const noexcept {return m_size == 0;}
+  size_t size () const noexcept {return m_size;}
+  void push (const Index &i) noexcept {m_data[m_size++] = i;}
+  Index pop () noexcept {return m_data[--m_size];}
+};
+
+
+/**
+ * Lazy input iterator over the key-value pairs of a tree inside a box
+ * Walks the tree one leaf at a time, keeping the hits of the current block of
+ * (at most 64) keys in a mask
+ */
+template<class Tree, class Container>
+class kd_query_iterator {
+  const Tree       *m_tree { nullptr };
+  const Container  *m_con { nullptr };
+  kd_stack<index_type> m_stack;
+  index_type        m_leaf { 0 };
+  bool              m_whole { false };
+  size_t            m_offset { 0 };
+  std::uint64_t     m_mask { 0 };
+  index_type        m_current { 0 };
+
+  void advance ()
   {
-    if (other.m_median != nullptr) {
-      this->m_median = m_coordAlloc.allocate(1);
-      m_coordAlloc.construct(this->m_median, *other.m_median);
-    }
-    if (other.m_leftChild != nullptr) {
-      if (other.m_leftChild->isLeaf())
-        this->m_leftChild = new kd_leaf<Key, T, Alloc>(*static_cast<kd_leaf<Key, T, Alloc>*>(other.m_leftChild));
-      else
-        this->m_leftChild = new kd_node<Key, T, Alloc>(*static_cast<kd_node<Key, T, Alloc>*>(other.m_leftChild));
-    }
-    if (other.m_rightChild != nullptr) {
-      if (other.m_rightChild->isLeaf())
-        this->m_rightChild = new kd_leaf<Key, T, Alloc>(*static_cast<kd_leaf<Key, T, Alloc>*>(other.m_rightChild));
-      else
-        this->m_rightChild = new kd_node<Key, T, Alloc>(*static_cast<kd_node<Key, T, Alloc>*>(other.m_rightChild));
+    while (true) {
+      if (m_mask) {
+        const auto &n = m_tree->m_nodeData[m_leaf];
+        m_current = static_cast<index_type>(n.GetBegin() + m_offset + first_set_bit(m_mask));
+        m_mask   &= m_mask - 1;
+        return;
+      }
+      if (m_offset + 64 < m_tree->m_nodeData[m_leaf].GetEnd() - m_tree->m_nodeData[m_leaf].GetBegin()) {
+        m_offset += 64;
+      }
+      else if (m_tree->NextLeaf(*m_con, m_stack, m_leaf, m_whole)) {
+        m_offset = 0;
+      }
+      else {
+        m_tree = nullptr;
+        return;
+      }
+      m_mask = m_tree->CheckChunk(m_tree->m_nodeData[m_leaf], *m_con, m_offset, m_whole);
     }
   }
-  kd_node (kd_node &&other) : kd_node_base(false), m_median(std::move(other.m_median)),
-                              m_leftChild(std::move(other.m_leftChild)), m_rightChild(std::move(other.m_rightChild))
-  {}
 
-  virtual ~kd_node ()
+public:
+
+  using value_type        = std::reference_wrapper<const typename Tree::value_type>;
+  using reference         = value_type;
+  using pointer           = const typename Tree::value_type*;
+  using difference_type   = std::ptrdiff_t;
+  using iterator_category = std::input_iterator_tag;
+
+  kd_query_iterator () = default;
+  kd_query_iterator (const Tree *tree, const Container *con) : m_tree(tree), m_con(con)
   {
-    if (m_median) {
-      m_coordAlloc.destroy(m_median);
-      m_coordAlloc.deallocate(m_median, 1);
+    if (!m_tree->m_nodeData.empty()) m_stack.push(0);
+    if (m_tree->NextLeaf(*m_con, m_stack, m_leaf, m_whole)) {
+      m_mask = m_tree->CheckChunk(m_tree->m_nodeData[m_leaf], *m_con, 0, m_whole);
+      advance();
+    }
+    else {
+      m_tree = nullptr;
     }
-    if (m_leftChild) delete m_leftChild;
-    if (m_rightChild) delete m_rightChild;
   }
 
-  const subkey_type& GetMedian () const noexcept {
-    return *m_median;
-  }
+  reference operator* () const {return std::cref(m_tree->m_valueData[m_current]);}
+  pointer operator-> () const {return &m_tree->m_valueData[m_current];}
 
-  const kd_node_base* GetLeftChild () const noexcept {
-    return m_leftChild;
-  }
+  kd_query_iterator& operator++ () {advance(); return *this;}
+  kd_query_iterator operator++ (int) {auto tmp = *this; advance(); return tmp;}
 
-  kd_node_base* GetLeftChild () noexcept {
-    return m_leftChild;
-  }
+  bool operator== (const kd_query_iterator &other) const
+  {return m_tree == other.m_tree && (m_tree == nullptr || m_current == other.m_current);}
+  bool operator!= (const kd_query_iterator &other) const {return !(*this == other);}
+};
 
-  const kd_node_base* GetRightChild () const noexcept {
-    return m_rightChild;
-  }
 
-  kd_node_base* GetRightChild () noexcept {
-    return m_rightChild;
-  }
+template<class Tree, class Container>
+class kd_query_range {
+  const Tree      *m_tree;
+  const Container *m_con;
+
+public:
+
+  using iterator = kd_query_iterator<Tree, Container>;
+
+  kd_query_range (const Tree *tree, const Container *con) : m_tree(tree), m_con(con) {}
+
+  iterator begin () const {return iterator(m_tree, m_con);}
+  iterator end () const {return iterator();}
 };
 
+// dual-tree walk behind join (kd_join.h)
+template<class TreeA, class TreeB, class Function>
+class kd_join;
+
 } // kd_tree_internal
 
 
+/**
+ * How the build chooses the coordinate and the value of every split
+ * cyclic            the coordinate after the parent's, at the median
+ * max_spread        the coordinate along which the keys spread the most, at
+ *                   the median
+ * sliding_midpoint  the coordinate of largest spread, halfway between the
+ *                   extreme keys (moved onto the nearest key when a side
+ *                   would be empty), for well-shaped cells on clustered data
+ * cost_model        the coordinate and value that minimize the expected number
+ *                   of keys visited by a query box with the sides given in
+ *                   kd_tree_options::query_extent (as in the surface area
+ *                   heuristic), chosen among sampled quantiles
+ * Every node stores its coordinate, so queries don't depend on the policy
+ * Policies other than cyclic need arithmetic coordinates, and are cyclic
+ * otherwise
+ */
+enum class kd_split { cyclic, max_spread, sliding_midpoint, cost_model };
+
+
+/**
+ * Build parameters
+ * leaf_size is the largest number of distinct keys stored in one leaf; leaves
+ * are scanned in bulk, so larger leaves make for shallower trees
+ * The tree built does not depend on the number of threads
+ */
+struct kd_tree_options {
+  size_t leaf_size { 32 };
+  // number of threads building the tree (0 uses all hardware threads)
+  size_t threads { 1 };
+  // ranges with fewer elements than this are always built by a single thread
+  size_t serial_cutoff { 1 << 16 };
+  // store the bounding box of every subtree, so that queries can skip
+  // subtrees outside the box and take whole subtrees inside it without
+  // testing their keys (costs 2 * dim coordinates per node)
+  bool bounding_boxes { false };
+  kd_split split { kd_split::cyclic };
+  // expected side of the query boxes along every coordinate (cost_model)
+  std::vector<double> query_extent;
+};
+
 
 template<class Key, class T,
-         class Compare = std::less<typename Key::value_type>,
-         class Equate  = std::equal_to<typename Key::value_type>,
+         class Compare = std::less<typename kd_key_traits<Key>::subkey_type>,
+         class Equate  = std::equal_to<typename kd_key_traits<Key>::subkey_type>,
          class Alloc   = std::allocator<std::pair<const Key, const T> > >
 class kd_tree {
 
-  kd_tree_internal::kd_node<Key, T, Alloc> *m_root { nullptr };
+  using node_type  = kd_tree_internal::kd_node<Key>;
+  using node_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<node_type>;
+  using index_type = kd_tree_internal::index_type;
+  template<class, class> friend class kd_tree_internal::kd_query_iterator;
+  template<class, class, class> friend class kd_tree_internal::kd_join;
+  using coord_alloc = typename std::allocator_traits<Alloc>::template
+                      rebind_alloc<typename kd_key_traits<Key>::subkey_type>;
+
   size_t  m_dim;
+  size_t  m_leafSize;
+  size_t  m_height { 0 };
   Compare m_comp;
   Equate  m_equate;
-  typename Key::allocator_type m_coordAlloc;
   Alloc   m_alloc;
-  std::forward_list < std::reference_wrapper < const std::pair<const Key, const T>>> m_values;
 
-  template<class RandomAccessIterator>
-  typename Key::value_type*
-  computeMedian (std::pair<RandomAccessIterator, RandomAccessIterator>&,
-                 const unsigned long long&);
-  template<class RandomAccessIterator>
+  // the arrays of a tree, which never change once it is built, so that
+  // copies (with an equal allocator) share them instead of copying them
+  struct storage_type {
+    std::vector<node_type, node_alloc> nodes;
+    std::vector<std::pair<const Key, const T>, Alloc> values;
+    // coordinates of each leaf's keys, stored dimension-major per leaf
+    std::vector<typename kd_key_traits<Key>::subkey_type, coord_alloc> coords;
+    // optional bounding box of every subtree: per node, the minima and then
+    // the maxima of all coordinates
+    std::vector<typename kd_key_traits<Key>::subkey_type, coord_alloc> bounds;
+
+    explicit storage_type (const Alloc &alloc) :
+      nodes(node_alloc(alloc)), values(alloc), coords(coord_alloc(alloc)), bounds(coord_alloc(alloc))
+    {}
+    storage_type (const kd_tree &tree, const Alloc &alloc) :
+      nodes(tree.m_nodeData.begin(), tree.m_nodeData.end(), node_alloc(alloc)),
+      values(tree.m_valueData.begin(), tree.m_valueData.end(), alloc),
+      coords(tree.m_coordData.begin(), tree.m_coordData.end(), coord_alloc(alloc)),
+      bounds(tree.m_boundData.begin(), tree.m_boundData.end(), coord_alloc(alloc))
+    {}
+  };
+  using storage_alloc = typename std::allocator_traits<Alloc>::template rebind_alloc<storage_type>;
+
+  std::shared_ptr<storage_type> m_storage;
+  // what the queries read: the arrays above, or the sections of a saved tree
+  // (which keeps its mapping alive)
+  kd_tree_internal::kd_span<node_type> m_nodeData;
+  kd_tree_internal::kd_span<std::pair<const Key, const T>> m_valueData;
+  kd_tree_internal::kd_span<typename kd_key_traits<Key>::subkey_type> m_coordData;
+  kd_tree_internal::kd_span<typename kd_key_traits<Key>::subkey_type> m_boundData;
+  std::shared_ptr<const kd_tree_internal::kd_mapping> m_mapping;
+
+  // the build moves positions in the input around instead of the key-value
+  // pairs, together with a point-major copy of their coordinates (a range is
+  // passed along with the coordinates of its first position)
+  using index_range = std::pair<index_type*, index_type*>;
+  using coord_ptr   = typename kd_key_traits<Key>::subkey_type*;
+
+  struct build_buffer {
+    std::vector<node_type> nodes;
+    // runs of equal keys, one per stored key-value pair, in leaf order
+    std::vector<index_range> groups;
+    // reused by the helpers for coordinates and positions being moved around
+    std::vector<typename kd_key_traits<Key>::subkey_type> scratch;
+    // smallest then largest coordinates of a range, as in m_bounds
+    std::vector<typename kd_key_traits<Key>::subkey_type> extent;
+    std::vector<index_type> positions;
+    size_t height { 0 };
+  };
+
+  void
+  buildParallel (index_range, coord_ptr,
+                 size_t, const size_t&, const size_t&,
+                 const kd_tree_options&, build_buffer&);
+  void
+  buildRange (index_range, coord_ptr,
+              size_t, const size_t&,
+              const kd_tree_options&, build_buffer&);
+  bool
+  chooseSplit (index_range&, coord_ptr,
+               size_t&,
+               typename kd_key_traits<Key>::subkey_type&,
+               const kd_tree_options&, build_buffer&);
+  bool
+  cyclicSplit (index_range&, coord_ptr,
+               size_t&,
+               typename kd_key_traits<Key>::subkey_type&,
+               build_buffer&);
+  bool
+  adaptiveSplit (index_range&, coord_ptr,
+                 size_t&,
+                 typename kd_key_traits<Key>::subkey_type&,
+                 const kd_tree_options&, build_buffer&,
+                 std::true_type);
+  bool
+  adaptiveSplit (index_range &range, coord_ptr coords,
+                 size_t &axis,
+                 typename kd_key_traits<Key>::subkey_type &median,
+                 const kd_tree_options&, build_buffer &buffer,
+                 std::false_type)
+  {return this->cyclicSplit(range, coords, axis, median, buffer);}
+  void
+  costSplit (const size_t&, coord_ptr,
+             size_t&,
+             typename kd_key_traits<Key>::subkey_type&,
+             const kd_tree_options&, build_buffer&);
+  void
+  slideMedian (std::vector<typename kd_key_traits<Key>::subkey_type>&,
+               typename kd_key_traits<Key>::subkey_type&);
+  typename kd_key_traits<Key>::subkey_type
+  computeMedian (std::vector<typename kd_key_traits<Key>::subkey_type>&);
+  bool
+  checkMedian (std::vector<typename kd_key_traits<Key>::subkey_type>&,
+               typename kd_key_traits<Key>::subkey_type&);
+  std::pair<index_range, index_range>
+  splitRange(index_range&, coord_ptr,
+             const size_t&,
+             const typename kd_key_traits<Key>::subkey_type&,
+             build_buffer&);
+  void
+  fillLeaf (index_range&, coord_ptr,
+            build_buffer&);
+  template<class RandomAccessIterator, class CollisionResolver>
   void
-  checkMedian (std::pair<RandomAccessIterator, RandomAccessIterator>&,
-               const unsigned long long&,
-               typename Key::value_type*&);
-  template<class ForwardIterator>
-  std::pair < std::pair<ForwardIterator, ForwardIterator>,
-  std::pair < ForwardIterator, ForwardIterator >>
-  splitRange(std::pair<ForwardIterator, ForwardIterator>&,
-             const unsigned long long&,
-             const typename Key::value_type&);
-  template<class ForwardIterator>
-  std::pair < std::pair<ForwardIterator, ForwardIterator>,
-  std::pair < ForwardIterator, ForwardIterator >>
-  specialSplitRange(std::pair<ForwardIterator, ForwardIterator>&,
-                    const Key&);
+  gatherValues (RandomAccessIterator,
+                build_buffer&,
+                const CollisionResolver&);
+  void computeBounds ();
+  void FillBounds (const node_type*, const size_t&,
+                   const typename kd_key_traits<Key>::subkey_type*,
+                   typename kd_key_traits<Key>::subkey_type*) const;
   template<class Container>
-  bool CheckKey (const Container&,
-                 const Key      &) const;
+  bool NextLeaf (const Container&,
+                 kd_tree_internal::kd_stack<index_type>&,
+                 index_type&, bool&) const;
+  template<class Container>
+  kd_tree_internal::overlap Overlap (const index_type&, const Container&) const;
+  template<class Container>
+  std::uint64_t CheckChunk (const node_type&,
+                            const Container&,
+                            const size_t&,
+                            const bool &whole = false) const;
+  template<class Metric, class Container, class Function>
+  void SearchBall (const Container&, const double&, Function) const;
+  template<class Metric>
+  kd_tree_internal::overlap BallOverlap (const index_type&, const double*, const double&) const;
+  template<class RandomAccessIterator, class Function>
+  void WalkBatch (RandomAccessIterator, const size_t&, const size_t&, Function&) const;
+  template<class RandomAccessIterator, class Function>
+  void RunBatch (RandomAccessIterator, RandomAccessIterator, const size_t&, Function) const;
 
   struct DefaultResolution {
     template <class RandomAccessIterator>
     T operator() (RandomAccessIterator, RandomAccessIterator l) const {return std::prev(l)->second;}
-  } m_defaultCR;
+  };
+
+  // constant for keys with a compile-time dimension
+  size_t Dim () const noexcept {
+    return kd_key_traits<Key>::dimension != 0 ? kd_key_traits<Key>::dimension : m_dim;
+  }
+
+  static const typename kd_key_traits<Key>::subkey_type& Coord (const Key &key, const size_t &i) {
+    return kd_key_traits<Key>::coord(key, i);
+  }
+
+  // points the views at the storage, or at the storage or mapping shared with
+  // source
+  void Attach (const kd_tree *source = nullptr) noexcept {
+    if (source != nullptr) {
+      m_nodeData  = source->m_nodeData;
+      m_valueData = source->m_valueData;
+      m_coordData = source->m_coordData;
+      m_boundData = source->m_boundData;
+    }
+    else if (m_storage) {
+      m_nodeData  = { m_storage->nodes.data(), m_storage->nodes.size() };
+      m_valueData = { m_storage->values.data(), m_storage->values.size() };
+      m_coordData = { m_storage->coords.data(), m_storage->coords.size() };
+      m_boundData = { m_storage->bounds.data(), m_storage->bounds.size() };
+    }
+    else {
+      m_nodeData  = {};
+      m_valueData = {};
+      m_coordData = {};
+      m_boundData = {};
+    }
+  }
+
+  // used by open
+  kd_tree () : m_dim(0), m_leafSize(1) {}
 
 public:
 
   using key_type    = Key;
   using stored_type = T;
-  using subkey_type = typename key_type::value_type;
+  using subkey_type = typename kd_key_traits<key_type>::subkey_type;
   // using keysize_type = typename key_type::size_type;
   using value_type  = std::pair<const key_type, const stored_type>;
   using key_compare = Compare;
@@ -194,8 +543,8 @@ public:
   using const_reference = const value_type &;
   using pointer         = typename std::allocator_traits<allocator_type>::pointer;
   using const_pointer   = typename std::allocator_traits<allocator_type>::const_pointer;
-  using iterator        = typename decltype(m_values)::iterator;
-  using const_iterator  = typename decltype(m_values)::const_iterator;
+  using iterator        = kd_tree_internal::kd_value_iterator<const value_type*>;
+  using const_iterator  = iterator;
   // using reverse_iterator = ;
   // using const_reverse_iterator = ;
   using difference_type = typename std::iterator_traits<iterator>::difference_type;
@@ -208,37 +557,122 @@ public:
    * of the form std::pair<Key, T>
    * Key should be forward iterable
    * T can be any copiable or copy-movable type
+   * The data is left untouched: the build works on positions into it and
+   * copies each key-value pair once at the end
    */
   template<class RandomAccessIterator>
   kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&);
   /**
    * CollisionResolver should return a new "stored_type" object given iterators
-   * to a sequence of elements that have the same key
+   * to a sequence of (copies of the) elements that have the same key, in the
+   * order of the data
    */
   template<class RandomAccessIterator, class CollisionResolver>
   kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&, const CollisionResolver&);
+  template<class RandomAccessIterator>
+  kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&, const kd_tree_options&);
+  template<class RandomAccessIterator, class CollisionResolver>
+  kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&, const CollisionResolver&,
+           const kd_tree_options&);
+  /**
+   * The nodes, the key-value pairs and the leaf coordinates are allocated with
+   * alloc (e.g. a kd_polymorphic_allocator over a kd_arena_resource sized with
+   * storage_bytes); temporary build buffers use the global heap
+   */
+  template<class RandomAccessIterator>
+  kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&, const kd_tree_options&,
+           const Alloc&);
+  template<class RandomAccessIterator, class CollisionResolver>
+  kd_tree (RandomAccessIterator, RandomAccessIterator, const size_t&, const CollisionResolver&,
+           const kd_tree_options&, const Alloc&);
+
+  /**
+   * Takes a vector of key-value pairs and moves them into the tree instead of
+   * copying them (the vector is left empty)
+   */
+  kd_tree (std::vector<std::pair<Key, T>> &&items, const size_t &dim,
+           const kd_tree_options &options = kd_tree_options(), const Alloc &alloc = Alloc()) :
+    kd_tree(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()), dim,
+            DefaultResolution(), options, alloc)
+  {
+    items.clear();
+  }
+  /**
+   * The CollisionResolver gets iterators to the pairs with the same key,
+   * moved out of the vector
+   */
+  template<class CollisionResolver>
+  kd_tree (std::vector<std::pair<Key, T>> &&items, const size_t &dim, const CollisionResolver &collisionResolver,
+           const kd_tree_options &options = kd_tree_options(), const Alloc &alloc = Alloc()) :
+    kd_tree(std::make_move_iterator(items.begin()), std::make_move_iterator(items.end()), dim,
+            collisionResolver, options, alloc)
+  {
+    items.clear();
+  }
 
+  /**
+   * Copies share the (immutable) arrays of the tree in O(1), unless the
+   * allocator of the copy is not equal to the tree's (e.g. a
+   * kd_polymorphic_allocator with another resource), in which case they are
+   * copied with it
+   */
   kd_tree (const kd_tree &other) :
-    m_root(new kd_tree_internal::kd_node<Key, T, Alloc>(*other.m_root)),
-    m_dim(other.m_dim), m_comp(other.m_comp), m_equate(other.m_equate),
-    m_alloc(other.m_alloc), m_values(other.m_values)
+    kd_tree(other, std::allocator_traits<Alloc>::select_on_container_copy_construction(other.m_alloc))
   {}
+  kd_tree (const kd_tree &other, const Alloc &alloc) :
+    m_dim(other.m_dim), m_leafSize(other.m_leafSize), m_height(other.m_height),
+    m_comp(other.m_comp), m_equate(other.m_equate), m_alloc(alloc),
+    m_mapping(other.m_mapping)
+  {
+    if (m_mapping || !other.m_storage || alloc == other.m_alloc) {
+      m_storage = other.m_storage;
+      this->Attach(&other);
+      return;
+    }
+    m_storage = std::allocate_shared<storage_type>(storage_alloc(alloc), other, alloc);
+    this->Attach();
+  }
   kd_tree (kd_tree &&other) :
-    m_root(std::move(other.m_root)), m_dim(std::move(other.m_dim)),
+    m_dim(std::move(other.m_dim)), m_leafSize(std::move(other.m_leafSize)),
+    m_height(std::move(other.m_height)),
     m_comp(std::move(other.m_comp)), m_equate(std::move(other.m_equate)),
-    m_alloc(std::move(other.m_alloc)), m_values(std::move(other.m_values))
+    m_alloc(std::move(other.m_alloc)),
+    m_storage(std::move(other.m_storage)),
+    m_mapping(std::move(other.m_mapping))
   {
-    other.m_root = nullptr;
+    this->Attach(&other);
+    other.m_height = 0;
+    other.Attach();
   }
 
-  virtual ~kd_tree () {
-    if (m_root) delete m_root;
-  }
+  virtual ~kd_tree () {}
 
   allocator_type get_allocator () const noexcept {
     return m_alloc;
   }
 
+  /**
+   * Estimate of the bytes allocated through Alloc for a tree of n keys of
+   * dimension dim, e.g. to size an arena up front (keys that own memory, like
+   * std::vector, allocate their copies separately)
+   */
+  static size_type storage_bytes (const size_type &n, const size_type &dim,
+                                  const kd_tree_options &options = kd_tree_options()) noexcept {
+    // most leaves hold at least half a bucket
+    auto leaves = 2 * n / std::max<size_type>(options.leaf_size, 1) + 1;
+    auto align  = alignof(std::max_align_t);
+    return (2 * leaves - 1) * sizeof(node_type) + n * sizeof(value_type) +
+           n * dim * sizeof(subkey_type) + sizeof(storage_type) + 5 * align;
+  }
+
+  size_type size () const noexcept {
+    return m_valueData.size();
+  }
+
+  bool empty () const noexcept {
+    return m_valueData.empty();
+  }
+
   /**
    * Container should be iterable and contain min/max pairs for each coordinate
    * Returns vector of key-value pairs in "sorted" order
@@ -248,14 +682,157 @@ public:
 
   std::forward_list < std::reference_wrapper < const value_type >>
   operator[](std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
-  {return (*this)[std::forward_list<std::pair<subkey_type, subkey_type>>(l)];}
+  {return this->operator[]<decltype(l)>(l);}
 
-  // iterate over all elements in tree in reverse order
-  iterator begin () {return m_values.begin();}
-  iterator end () {return m_values.end();}
-  const_iterator cbegin () const {return m_values.cbegin();}
-  const_iterator cend () const {return m_values.cend();}
+  /**
+   * Same boxes as operator[], without materializing the results and without
+   * allocating
+   * for_each_in calls f with every key-value pair in the box, count only
+   * counts them and any_in stops at the first one
+   * select returns a range of lazy input iterators over the key-value pairs in
+   * the box (the box must outlive the iterators)
+   */
+  template<class Container, class Function>
+  void for_each_in (const Container&, Function) const;
+
+  template<class Function>
+  void for_each_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l, Function f) const
+  {this->for_each_in<decltype(l), Function>(l, f);}
+
+  template<class Container>
+  size_type count (const Container&) const;
+
+  size_type count (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->count<decltype(l)>(l);}
+
+  template<class Container>
+  bool any_in (const Container&) const;
+
+  bool any_in (std::initializer_list<std::pair<subkey_type, subkey_type>> l) const
+  {return this->any_in<decltype(l)>(l);}
+
+  template<class Container>
+  kd_tree_internal::kd_query_range<kd_tree, Container> select (const Container &con) const
+  {return kd_tree_internal::kd_query_range<kd_tree, Container>(this, &con);}
+
+  /**
+   * Batched versions of the box queries for random-access ranges of boxes
+   * The tree is walked once for the whole batch: at each node the boxes still
+   * active are split between the children, and each leaf is tested against
+   * all of the boxes that reach it while it is in cache
+   * With threads > 1 the batch is split into contiguous parts walked
+   * concurrently (f is then called concurrently, though never concurrently
+   * for the same box)
+   * for_each_in_batch calls f(box index, key-value pair) for every hit
+   */
+  template<class RandomAccessIterator, class Function>
+  void for_each_in_batch (RandomAccessIterator, RandomAccessIterator, Function,
+                          const size_t &threads = 1) const;
+
+  template<class RandomAccessIterator>
+  std::vector<size_type> count_batch (RandomAccessIterator, RandomAccessIterator,
+                                      const size_t &threads = 1) const;
+
+  template<class RandomAccessIterator>
+  std::vector < std::vector < std::reference_wrapper < const value_type >>>
+  query_batch (RandomAccessIterator, RandomAccessIterator,
+               const size_t &threads = 1) const;
+
+  /**
+   * Container should be iterable and contain the coordinates of a point
+   * Returns (at most) the k key-value pairs closest to the point according to
+   * Metric, closest first
+   * With epsilon > 0 the search may stop early; every returned pair is then
+   * within (1 + epsilon) times the distance of the true i-th nearest pair
+   * Only for arithmetic coordinates; throws std::invalid_argument if the point
+   * has fewer coordinates than the keys
+   */
+  template<class Metric = kd_metric::L2, class Container>
+  std::vector < std::reference_wrapper < const value_type >>
+  nearest (const Container&, const size_t&, const double &epsilon = 0) const;
+
+  template<class Metric = kd_metric::L2>
+  std::vector < std::reference_wrapper < const value_type >>
+  nearest (std::initializer_list<subkey_type> l, const size_t &k, const double &epsilon = 0) const
+  {return this->nearest<Metric>(std::vector<subkey_type>(l), k, epsilon);}
+
+  /**
+   * Container should be iterable and contain the coordinates of a point
+   * for_each_within calls f with every key-value pair at most radius away
+   * from the point according to Metric, without allocating; count_within
+   * counts them and within_radius returns them, in leaf order
+   * Subtrees are skipped by their distance to the point (that of their cell,
+   * or of their bounding box if the tree stores them), and the distances of
+   * the keys in a leaf are computed up to 64 at a time, one coordinate at a
+   * time (vectorized for double coordinates and the metrics of kd_metric)
+   * Only for arithmetic coordinates; throws std::invalid_argument if the point
+   * has fewer coordinates than the keys
+   */
+  template<class Metric = kd_metric::L2, class Container, class Function>
+  void for_each_within (const Container&, const double&, Function) const;
+
+  template<class Metric = kd_metric::L2, class Function>
+  void for_each_within (std::initializer_list<subkey_type> l, const double &radius, Function f) const
+  {this->for_each_within<Metric>(std::vector<subkey_type>(l), radius, f);}
+
+  template<class Metric = kd_metric::L2, class Container>
+  size_type count_within (const Container&, const double&) const;
+
+  template<class Metric = kd_metric::L2>
+  size_type count_within (std::initializer_list<subkey_type> l, const double &radius) const
+  {return this->count_within<Metric>(std::vector<subkey_type>(l), radius);}
+
+  template<class Metric = kd_metric::L2, class Container>
+  std::vector < std::reference_wrapper < const value_type >>
+  within_radius (const Container&, const double&) const;
+
+  template<class Metric = kd_metric::L2>
+  std::vector < std::reference_wrapper < const value_type >>
+  within_radius (std::initializer_list<subkey_type> l, const double &radius) const
+  {return this->within_radius<Metric>(std::vector<subkey_type>(l), radius);}
+
+  /**
+   * Writes the tree to a file that open can map back without rebuilding it
+   * Keys and stored values must be trivially copyable (e.g. std::array keys)
+   * The file is written next to path and renamed over it once complete
+   */
+  void save (const std::string &path) const;
+  /**
+   * Maps a file written by save and returns a read-only tree that answers
+   * queries directly from the mapping, without deserializing it
+   * Throws std::runtime_error if the file can't be read or doesn't hold a
+   * tree of this type; verify also checks the checksum and the node indices
+   * (which reads the whole file once)
+   */
+  static kd_tree open (const std::string &path, const bool &verify = true);
+
+  /**
+   * Number of leaves at every depth (the root is at depth 0), e.g. to check
+   * how balanced the tree is
+   */
+  std::vector<size_type> depth_histogram () const;
+
+  // all elements in leaf order, as one array
+  const value_type *data () const noexcept {return m_valueData.data();}
+
+  // iterate over all elements in tree in leaf order
+  iterator begin () const {return iterator(m_valueData.begin());}
+  iterator end () const {return iterator(m_valueData.end());}
+  const_iterator cbegin () const {return const_iterator(m_valueData.begin());}
+  const_iterator cend () const {return const_iterator(m_valueData.end());}
 };
+
+
+/**
+ * Tree over keys with a dimension fixed at compile time, stored inline
+ * Has the same interface as a tree over std::vector keys (the dimension
+ * passed to the constructors must be D)
+ */
+template<class S, size_t D, class T,
+         class Compare = std::less<S>,
+         class Equate  = std::equal_to<S>,
+         class Alloc   = std::allocator<std::pair<const std::array<S, D>, const T> > >
+using fixed_kd_tree = kd_tree<std::array<S, D>, T, Compare, Equate, Alloc>;
 }
 
 #include "kd_tree.icc"
@@ -0,0 +1,714 @@
+// compile with
+// clang++ -std=c++11 -O2 -march=native -pthread -I. -Wall src/benchmark.cpp -o bin/kD-tree-benchmark
+
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <array>
+#include <cstdlib>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kd_tree/dynamic_kd_tree.h"
+#include "kd_tree/concurrent_kd_tree.h"
+#include "kd_tree/kd_join.h"
+#include "kd_tree/external_kd_tree.h"
+#include "var.h"
+
+using namespace std;
+
+using point_type = pair < vector<double>, int >;
+using box_type   = vector < pair < double, double >>;
+using tree_type  = Analysis::kd_tree<vector<double>, int>;
+using fixed_type = Analysis::fixed_kd_tree<double, 3, int>;
+using arena_type = Analysis::fixed_kd_tree<double, 3, int, less<double>, equal_to<double>,
+                                           Analysis::kd_polymorphic_allocator<fixed_type::value_type>>;
+
+
+template<class Function>
+double seconds (Function &&f)
+{
+  auto start = chrono::steady_clock::now();
+  f();
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+vector<point_type> uniform_points (const size_t &n, const size_t &dim, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0, 1);
+  vector<point_type> points(n);
+  for (size_t i = 0; i < n; ++i) {
+    points[i].first.resize(dim);
+    for (auto &c : points[i].first) c = uniform(gen);
+    points[i].second = static_cast<int>(i);
+  }
+  return points;
+}
+
+
+// boxes with a side of width each, fully inside the unit cube
+vector<box_type> uniform_boxes (const size_t &n, const size_t &dim, const double &width, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0, 1 - width);
+  vector<box_type> boxes(n, box_type(dim));
+  for (auto &box : boxes)
+    for (auto &side : box) {
+      side.first  = uniform(gen);
+      side.second = side.first + width;
+    }
+  return boxes;
+}
+
+
+void report (const string &name, const size_t &queries, const double &time, const double &baseline)
+{
+  cout << "  " << left << setw(34) << name << right
+       << setw(10) << fixed << setprecision(4) << time << " s"
+       << setw(14) << setprecision(0) << queries / time << " queries/s"
+       << setw(8) << setprecision(2) << baseline / time << "x" << endl;
+}
+
+
+// O(1) copies sharing the storage, and builds that move the pairs in
+void copy_benchmark (const tree_type &tree, const vector<point_type> &points, const double &build)
+{
+  cout << "copies and moved input (std::vector<double> keys):" << endl;
+
+  unique_ptr<tree_type> copied;
+  auto copy = seconds([&]() {copied.reset(new tree_type(tree));});
+  cout << "  " << left << setw(34) << "copy" << right
+       << setw(10) << fixed << setprecision(6) << copy << " s"
+       << (copied->data() == tree.data() ? "  shared with the original" : "  deep copy") << endl;
+  copied.reset();
+
+  auto input = points;
+  auto moved = seconds([&]() {copied.reset(new tree_type(std::move(input), points.front().first.size()));});
+  cout << "  " << left << setw(34) << "build from an rvalue vector" << right
+       << setw(10) << fixed << setprecision(4) << moved << " s"
+       << setw(14) << copied->size() << " keys     "
+       << setw(8) << setprecision(2) << build / moved << "x\n" << endl;
+}
+
+
+void batch_benchmark (const tree_type &tree, const vector<box_type> &boxes, const size_t &threads)
+{
+  size_t loop_hits = 0, batch_hits = 0;
+
+  cout << "batched queries (" << boxes.size() << " boxes):" << endl;
+
+  auto loop = seconds([&]() {
+                        for (auto &box : boxes) loop_hits += tree.count(box);
+                      });
+  report("loop over count", boxes.size(), loop, loop);
+  auto batch = seconds([&]() {
+                         for (auto c : tree.count_batch(boxes.begin(), boxes.end())) batch_hits += c;
+                       });
+  report("count_batch", boxes.size(), batch, loop);
+  if (threads > 1) {
+    batch = seconds([&]() {tree.count_batch(boxes.begin(), boxes.end(), threads);});
+    report("count_batch (" + to_string(threads) + " threads)", boxes.size(), batch, loop);
+  }
+
+  auto list_loop = seconds([&]() {
+                             for (auto &box : boxes) tree[box];
+                           });
+  report("loop over operator[]", boxes.size(), list_loop, list_loop);
+  batch = seconds([&]() {tree.query_batch(boxes.begin(), boxes.end());});
+  report("query_batch", boxes.size(), batch, list_loop);
+  if (threads > 1) {
+    batch = seconds([&]() {tree.query_batch(boxes.begin(), boxes.end(), threads);});
+    report("query_batch (" + to_string(threads) + " threads)", boxes.size(), batch, list_loop);
+  }
+
+  if (loop_hits != batch_hits) cout << "  MISMATCH: " << loop_hits << " vs " << batch_hits << endl;
+  cout << endl;
+}
+
+
+void bounds_benchmark (const tree_type &tree, vector<point_type> points, const vector<box_type> &small,
+                       const vector<box_type> &large)
+{
+  Analysis::kd_tree_options options;
+  options.bounding_boxes = true;
+  tree_type bounded(points.begin(), points.end(), points.front().first.size(), options);
+
+  cout << "subtree bounding boxes:" << endl;
+  for (auto boxes : { &small, &large }) {
+    const string kind = boxes == &small ? "small" : "large";
+    size_t hits = 0, bounded_hits = 0;
+    auto loop = seconds([&]() {
+                          for (auto &box : *boxes) hits += tree.count(box);
+                        });
+    report("count, " + kind + " boxes", boxes->size(), loop, loop);
+    auto bounded_loop = seconds([&]() {
+                                  for (auto &box : *boxes) bounded_hits += bounded.count(box);
+                                });
+    report("count, " + kind + " boxes (bounded)", boxes->size(), bounded_loop, loop);
+    if (hits != bounded_hits) cout << "  MISMATCH: " << hits << " vs " << bounded_hits << endl;
+  }
+  cout << endl;
+}
+
+
+void dynamic_benchmark (const vector<pair<array<double, 3>, int>> &points, const vector<box_type> &boxes)
+{
+  using dynamic_type = Analysis::dynamic_kd_tree<array<double, 3>, int>;
+
+  cout << "dynamic tree (std::array<double, 3> keys):" << endl;
+
+  dynamic_type dynamic(3);
+  auto insert = seconds([&]() {
+                          for (auto &p : points) dynamic.insert(p.first, p.second);
+                        });
+  cout << "  insert: " << fixed << setprecision(4) << insert << " s ("
+       << setprecision(0) << points.size() / insert << " inserts/s, "
+       << dynamic.components() << " components)" << endl;
+
+  unique_ptr<fixed_type> fresh;
+  auto build = seconds([&]() {fresh.reset(new fixed_type(points.begin(), points.end(), 3));});
+  cout << "  static build of the same points: " << setprecision(4) << build << " s" << endl;
+
+  size_t static_hits = 0, dynamic_hits = 0;
+  auto static_loop = seconds([&]() {
+                               for (auto &box : boxes) static_hits += fresh->count(box);
+                             });
+  report("count (static tree)", boxes.size(), static_loop, static_loop);
+  auto dynamic_loop = seconds([&]() {
+                                for (auto &box : boxes) dynamic_hits += dynamic.count(box);
+                              });
+  report("count (dynamic tree)", boxes.size(), dynamic_loop, static_loop);
+  if (static_hits != dynamic_hits) cout << "  MISMATCH: " << static_hits << " vs " << dynamic_hits << endl;
+
+  auto erase = seconds([&]() {
+                         for (size_t i = 0; i < points.size(); i += 10) dynamic.erase(points[i].first);
+                       });
+  cout << "  erase every 10th point: " << setprecision(4) << erase << " s ("
+       << setprecision(0) << points.size() / 10 / erase << " erases/s)" << endl;
+  dynamic_loop = seconds([&]() {
+                           for (auto &box : boxes) dynamic.count(box);
+                         });
+  report("count (after erasing)", boxes.size(), dynamic_loop, static_loop);
+  auto compact = seconds([&]() {dynamic.compact();});
+  cout << "  compact: " << setprecision(4) << compact << " s" << endl;
+  dynamic_loop = seconds([&]() {
+                           for (auto &box : boxes) dynamic.count(box);
+                         });
+  report("count (after compacting)", boxes.size(), dynamic_loop, static_loop);
+  cout << endl;
+}
+
+
+// readers counting boxes while the tree is rebuilt a few times: behind one
+// mutex that is also held while rebuilding, and through concurrent_kd_tree
+void concurrent_benchmark (const vector<pair<array<double, 3>, int>> &points, const vector<box_type> &boxes,
+                           const size_t &threads)
+{
+  using shared_type = Analysis::concurrent_kd_tree<array<double, 3>, int>;
+  const size_t rebuilds = 3;
+
+  cout << "readers during " << rebuilds << " rebuilds (" << threads << " reader threads):" << endl;
+
+  // runs the readers until write() returns; returns the number of queries
+  // and the longest one
+  auto run = [&](function<void(size_t&, const box_type&)> query, function<void()> write) {
+               atomic<bool>   stop { false };
+               vector<size_t> served(threads, 0);
+               vector<double> longest(threads, 0);
+               vector<thread> readers;
+
+               for (size_t r = 0; r < threads; ++r)
+                 readers.emplace_back([&, r]() {
+                                        size_t hits = 0;
+                                        for (size_t q = r; !stop.load(); q = (q + threads) % boxes.size()) {
+                                          auto t = seconds([&]() {query(hits, boxes[q]);});
+                                          longest[r] = max(longest[r], t);
+                                          ++served[r];
+                                        }
+                                      });
+               auto total = seconds(write);
+               stop = true;
+               for (auto &r : readers) r.join();
+               size_t queries = 0;
+               for (auto &s : served) queries += s;
+               return make_pair(queries / total, *max_element(longest.begin(), longest.end()));
+             };
+
+  mutex locked_mutex;
+  unique_ptr<fixed_type> locked(new fixed_type(points.begin(), points.end(), 3));
+  auto mutexed = run([&](size_t &hits, const box_type &box) {
+                       lock_guard<mutex> lock(locked_mutex);
+                       hits += locked->count(box);
+                     },
+                     [&]() {
+                       for (size_t i = 0; i < rebuilds; ++i) {
+                         lock_guard<mutex> lock(locked_mutex);
+                         locked.reset(new fixed_type(points.begin(), points.end(), 3));
+                       }
+                     });
+
+  shared_type shared(fixed_type(points.begin(), points.end(), 3));
+  auto rcu = run([&](size_t &hits, const box_type &box) {
+                   hits += shared.read([&](const fixed_type &tree) {return tree.count(box);});
+                 },
+                 [&]() {
+                   for (size_t i = 0; i < rebuilds; ++i)
+                     shared.rebuild([&]() {return fixed_type(points.begin(), points.end(), 3);}).get();
+                 });
+
+  cout << "  " << left << setw(34) << "global mutex" << right << fixed
+       << setw(14) << setprecision(0) << mutexed.first << " queries/s, longest "
+       << setprecision(4) << mutexed.second << " s" << endl;
+  cout << "  " << left << setw(34) << "concurrent_kd_tree" << right
+       << setw(14) << setprecision(0) << rcu.first << " queries/s, longest "
+       << setprecision(4) << rcu.second << " s" << endl;
+  cout << endl;
+}
+
+
+// count queries on trees built with every split policy from the same keys,
+// against the default (cyclic) policy
+void split_benchmark (const string &name, const vector<pair<array<double, 3>, int>> &points,
+                      const vector<box_type> &boxes, const vector<double> &query_extent)
+{
+  const pair<Analysis::kd_split, const char*> policies[] = {
+    { Analysis::kd_split::cyclic, "cyclic" },
+    { Analysis::kd_split::max_spread, "max_spread" },
+    { Analysis::kd_split::sliding_midpoint, "sliding_midpoint" },
+    { Analysis::kd_split::cost_model, "cost_model" }
+  };
+
+  cout << "split policies, " << name << ":" << endl;
+
+  double baseline = 0;
+  size_t baseline_hits = 0;
+  for (auto &policy : policies) {
+    Analysis::kd_tree_options options;
+    options.split        = policy.first;
+    options.query_extent = query_extent;
+
+    unique_ptr<fixed_type> tree;
+    auto build = seconds([&]() {tree.reset(new fixed_type(points.begin(), points.end(), 3, options));});
+
+    size_t hits = 0;
+    auto loop = seconds([&]() {
+                          for (auto &box : boxes) hits += tree->count(box);
+                        });
+    if (policy.first == Analysis::kd_split::cyclic) {
+      baseline      = loop;
+      baseline_hits = hits;
+    }
+    report(string(policy.second) + " (build " + to_string(build).substr(0, 5) + " s)", boxes.size(), loop, baseline);
+    if (hits != baseline_hits) cout << "  MISMATCH: " << hits << " vs " << baseline_hits << endl;
+  }
+  cout << endl;
+}
+
+
+// keys spanning 1e6 along x and 1e-2 along y and z, and keys in 20 tight
+// clusters, queried with boxes sized for the data
+void splits_benchmark (const size_t &n, const size_t &queries, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0, 1);
+  normal_distribution<double>       normal(0, 0.01);
+  vector<pair<array<double, 3>, int>> anisotropic(n), clustered(n);
+  vector<array<double, 3>> centers(20);
+
+  for (auto &c : centers) c = { { uniform(gen), uniform(gen), uniform(gen) } };
+  for (size_t i = 0; i < n; ++i) {
+    const auto &c = centers[i % centers.size()];
+    anisotropic[i] = { { { 1e6 * uniform(gen), 1e-2 * uniform(gen), 1e-2 * uniform(gen) } }, static_cast<int>(i) };
+    clustered[i]   = { { { c[0] + normal(gen), c[1] + normal(gen), c[2] + normal(gen) } }, static_cast<int>(i) };
+  }
+
+  const vector<double> anisotropic_extent = { 1e3, 1e-3, 1e-3 }, clustered_extent = { 0.005, 0.005, 0.005 };
+  vector<box_type> anisotropic_boxes(queries, box_type(3)), clustered_boxes(queries, box_type(3));
+  for (size_t q = 0; q < queries; ++q) {
+    const auto &c = centers[q % centers.size()];
+    for (size_t d = 0; d < 3; ++d) {
+      auto a = (d == 0 ? 1e6 : 1e-2) * uniform(gen), b = c[d] + 3 * normal(gen);
+      anisotropic_boxes[q][d] = { a, a + anisotropic_extent[d] };
+      clustered_boxes[q][d]   = { b, b + clustered_extent[d] };
+    }
+  }
+
+  split_benchmark("anisotropic keys", anisotropic, anisotropic_boxes, anisotropic_extent);
+  split_benchmark("clustered keys", clustered, clustered_boxes, clustered_extent);
+}
+
+
+// ball queries against the bounding box of the ball filtered by distance
+template<class Metric>
+void radius_benchmark (const string &name, const fixed_type &tree, const vector<array<double, 3>> &centers,
+                       const double &radius)
+{
+  size_t box_hits = 0, ball_hits = 0;
+  auto filtered = seconds([&]() {
+                            for (auto &c : centers) {
+                              box_type box { { c[0] - radius, c[0] + radius }, { c[1] - radius, c[1] + radius },
+                                             { c[2] - radius, c[2] + radius } };
+                              tree.for_each_in(box, [&](const fixed_type::value_type &v) {
+                                double distance = 0;
+                                for (size_t d = 0; d < 3; ++d)
+                                  distance = Metric::combine(distance, Metric::term(v.first[d] - c[d]));
+                                box_hits += distance <= Metric::reduce(radius);
+                              });
+                            }
+                          });
+  auto ball = seconds([&]() {
+                        for (auto &c : centers)
+                          tree.template for_each_within<Metric>(c, radius,
+                                                                [&](const fixed_type::value_type&) {++ball_hits;});
+                      });
+  report(name + " box + filter", centers.size(), filtered, filtered);
+  report(name + " for_each_within", centers.size(), ball, filtered);
+  if (box_hits != ball_hits) cout << "  MISMATCH: " << ball_hits << " vs " << box_hits << endl;
+}
+
+
+void radius_benchmarks (const vector<pair<array<double, 3>, int>> &points, const size_t &queries, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0.1, 0.9);
+  vector<array<double, 3>> centers(queries);
+  for (auto &c : centers) c = { { uniform(gen), uniform(gen), uniform(gen) } };
+
+  for (bool boxes : { false, true }) {
+    Analysis::kd_tree_options options;
+    options.bounding_boxes = boxes;
+    fixed_type tree(points.begin(), points.end(), 3, options);
+
+    cout << "radius queries, r = 0.05 (std::array<double, 3> keys" << (boxes ? ", bounding boxes" : "")
+         << "):" << endl;
+    radius_benchmark<Analysis::kd_metric::L2>("L2", tree, centers, 0.05);
+    radius_benchmark<Analysis::kd_metric::L1>("L1", tree, centers, 0.05);
+    radius_benchmark<Analysis::kd_metric::Linf>("Linf", tree, centers, 0.05);
+    cout << endl;
+  }
+}
+
+
+// join of integer keys next to the ends of their range (where the box around a
+// key is clamped) against a brute-force count
+template<class Subkey>
+void integer_join_check (const string &name, const vector<Subkey> &values, const Subkey &tolerance,
+                         const size_t &threads)
+{
+  using int_tree = Analysis::fixed_kd_tree<Subkey, 2, int>;
+
+  vector<pair<array<Subkey, 2>, int>> points;
+  for (size_t i = 0; i < values.size(); ++i)
+    points.push_back({ { { values[i], values[values.size() - 1 - i] } }, static_cast<int>(i) });
+  Analysis::kd_tree_options options;
+  options.leaf_size = 4;
+  int_tree tree(points.begin(), points.end(), 2, options);
+
+  // differences taken on the unsigned type, which holds them without overflow
+  using unsigned_type = typename make_unsigned<Subkey>::type;
+  auto near = [&tolerance](const Subkey &a, const Subkey &b) {
+                const auto low = static_cast<unsigned_type>(min(a, b)), high = static_cast<unsigned_type>(max(a, b));
+                return static_cast<unsigned_type>(high - low) <= static_cast<unsigned_type>(tolerance);
+              };
+  size_t brute = 0;
+  for (auto &a : points)
+    for (auto &b : points) brute += near(a.first[0], b.first[0]) && near(a.first[1], b.first[1]);
+
+  atomic<size_t> pairs { 0 };
+  Analysis::join(tree, tree, { tolerance, tolerance },
+                 [&pairs](const typename int_tree::value_type&, const typename int_tree::value_type&) {
+                   pairs.fetch_add(1, memory_order_relaxed);
+                 }, threads);
+  cout << "  " << left << setw(34) << name << right << setw(10) << pairs << " pairs"
+       << (pairs == brute ? "" : "  MISMATCH: " + to_string(brute) + " by brute force") << endl;
+}
+
+
+// dual-tree join of two point sets against one box query per point of the first
+void join_benchmark (const vector<pair<array<double, 3>, int>> &points, const size_t &threads, mt19937_64 &gen)
+{
+  const double tolerance = 0.005;
+  uniform_real_distribution<double> uniform(0, 1);
+  vector<pair<array<double, 3>, int>> others(points.size() / 4);
+  for (size_t i = 0; i < others.size(); ++i)
+    others[i] = { { { uniform(gen), uniform(gen), uniform(gen) } }, static_cast<int>(i) };
+
+  fixed_type tree(points.begin(), points.end(), 3), other_tree(others.begin(), others.end(), 3);
+
+  cout << "join of " << others.size() << " x " << points.size() << " keys, tolerance " << setprecision(3) << tolerance
+       << " (std::array<double, 3> keys):" << endl;
+
+  // the points of the first set in input order, and in the order of its tree
+  size_t loop_pairs = 0, sorted_pairs = 0;
+  auto box_of = [&tolerance](const array<double, 3> &k) {
+                  return box_type { { k[0] - tolerance, k[0] + tolerance }, { k[1] - tolerance, k[1] + tolerance },
+                                    { k[2] - tolerance, k[2] + tolerance } };
+                };
+  auto loop = seconds([&]() {
+                        for (auto &v : others)
+                          tree.for_each_in(box_of(v.first), [&](const fixed_type::value_type&) {++loop_pairs;});
+                      });
+  auto sorted = seconds([&]() {
+                          for (auto v : other_tree)
+                            tree.for_each_in(box_of(v.get().first), [&](const fixed_type::value_type&) {++sorted_pairs;});
+                        });
+  report("loop over for_each_in", others.size(), loop, loop);
+  report("loop over for_each_in, tree order", others.size(), sorted, loop);
+  if (sorted_pairs != loop_pairs) cout << "  MISMATCH: " << sorted_pairs << " vs " << loop_pairs << endl;
+
+  for (size_t t : { size_t(1), threads }) {
+    atomic<size_t> pairs { 0 };
+    auto joined = seconds([&]() {
+                            Analysis::join(other_tree, tree, { tolerance, tolerance, tolerance },
+                                           [&pairs](const fixed_type::value_type&, const fixed_type::value_type&) {
+                                             pairs.fetch_add(1, memory_order_relaxed);
+                                           }, t);
+                          });
+    report("join (" + to_string(t) + (t == 1 ? " thread)" : " threads)"), others.size(), joined, loop);
+    if (pairs != loop_pairs) cout << "  MISMATCH: " << pairs << " vs " << loop_pairs << endl;
+  }
+
+  vector<uint64_t> unsigned_values;
+  vector<int64_t>  signed_values;
+  for (uint64_t i = 0; i < 200; ++i) unsigned_values.push_back(i % 2 ? numeric_limits<uint64_t>::max() - i : i);
+  for (int64_t i = 0; i < 200; ++i)
+    signed_values.push_back(i % 2 ? numeric_limits<int64_t>::max() - i : numeric_limits<int64_t>::min() + i);
+  integer_join_check<uint64_t>("join of uint64_t keys", unsigned_values, 3, threads);
+  integer_join_check<int64_t>("join of int64_t keys", signed_values, 3, threads);
+  cout << endl;
+}
+
+
+// mixed-type keys (double, int, string) compared through VarBaseSortable, against
+// the same keys encoded as order-preserving integers
+void encoded_benchmark (const size_t &n, const size_t &queries, mt19937_64 &gen)
+{
+  using var_tree  = Analysis::kd_tree<vector<VarBaseSortable*>, int, VarBaseSortable::Less, VarBaseSortable::Equate>;
+  using code_tree = Analysis::fixed_kd_tree<Analysis::kd_code, 3, int>;
+
+  cout << "mixed-type keys (double, int, string), " << n << " keys:" << endl;
+
+  uniform_real_distribution<double> uniform(0, 1);
+  uniform_int_distribution<int>     integer(0, 999), word(0, 9999);
+  vector<unique_ptr<VarBaseSortable>>  vars;
+  vector<vector<VarBaseSortable*>> keys(n);
+  vector<pair<vector<VarBaseSortable*>, int>> records(n);
+  auto make = [&vars](VarBaseSortable *v) {vars.emplace_back(v); return v;};
+  auto name = [](const int &w) {string s = to_string(w); return string(5 - s.size(), '0') + s;};
+  for (size_t i = 0; i < n; ++i) {
+    keys[i]    = { make(new Var<double>(uniform(gen))), make(new Var<int>(integer(gen))),
+                   make(new Var<string>(name(word(gen)))) };
+    records[i] = { keys[i], static_cast<int>(i) };
+  }
+
+  vector<vector<pair<VarBaseSortable*, VarBaseSortable*>>> boxes(queries);
+  for (auto &box : boxes) {
+    double x = 0.8 * uniform(gen);
+    int    y = integer(gen) * 4 / 5, z = word(gen) * 4 / 5;
+    box = { { make(new Var<double>(x)), make(new Var<double>(x + 0.2)) },
+            { make(new Var<int>(y)), make(new Var<int>(y + 200)) },
+            { make(new Var<string>(name(z))), make(new Var<string>(name(z + 2000))) } };
+  }
+
+  unique_ptr<var_tree> vtree;
+  auto var_build = seconds([&]() {vtree.reset(new var_tree(records.begin(), records.end(), 3));});
+
+  // encoding (and the string dictionary) is part of the build, and of each query
+  unique_ptr<VarEncoder> encoder;
+  unique_ptr<code_tree>  ctree;
+  auto code_build = seconds([&]() {
+                              encoder.reset(new VarEncoder(keys.begin(), keys.end()));
+                              vector<pair<array<Analysis::kd_code, 3>, int>> encoded(n);
+                              for (size_t i = 0; i < n; ++i) {
+                                for (size_t d = 0; d < 3; ++d) encoded[i].first[d] = encoder->Encode(keys[i][d], d);
+                                encoded[i].second = records[i].second;
+                              }
+                              ctree.reset(new code_tree(encoded.begin(), encoded.end(), 3));
+                            });
+  cout << "  build: " << fixed << setprecision(4) << var_build << " s with VarBaseSortable*, "
+       << code_build << " s encoded (" << setprecision(2) << var_build / code_build << "x)" << endl;
+
+  size_t var_hits = 0, code_hits = 0;
+  auto var_loop = seconds([&]() {
+                            for (auto &box : boxes) var_hits += vtree->count(box);
+                          });
+  auto code_loop = seconds([&]() {
+                             vector<pair<Analysis::kd_code, Analysis::kd_code>> encoded(3);
+                             for (auto &box : boxes) {
+                               for (size_t d = 0; d < 3; ++d)
+                                 encoded[d] = encoder->EncodeBounds(box[d].first, box[d].second, d);
+                               code_hits += ctree->count(encoded);
+                             }
+                           });
+  report("count, VarBaseSortable* keys", boxes.size(), var_loop, var_loop);
+  report("count, encoded keys", boxes.size(), code_loop, var_loop);
+  if (var_hits != code_hits) cout << "  MISMATCH: " << code_hits << " vs " << var_hits << endl;
+  cout << endl;
+}
+
+
+// external build through a memory budget of a tenth of the input, against the
+// in-memory build, and queries that map its subtrees on demand
+void external_benchmark (const vector<pair<array<double, 3>, int>> &points, const vector<box_type> &boxes)
+{
+  using external_type = Analysis::external_kd_tree<array<double, 3>, int>;
+
+  const string input = "kD-tree-external.bin", directory = "kD-tree-external";
+  {
+    vector<Analysis::kd_record<array<double, 3>, int>> records(points.size());
+    for (size_t i = 0; i < points.size(); ++i) records[i] = { points[i].first, points[i].second };
+    ofstream out(input, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(records[0]));
+  }
+  mkdir(directory.c_str(), 0755);
+
+  Analysis::external_kd_tree_options options;
+  options.memory_budget = points.size() * sizeof(points[0]) / 10;
+
+  cout << "external build (std::array<double, 3> keys, budget " << options.memory_budget / 1024 << " KiB):" << endl;
+  unique_ptr<fixed_type>    tree;
+  unique_ptr<external_type> external;
+  auto build          = seconds([&]() {tree.reset(new fixed_type(points.begin(), points.end(), 3));});
+  auto external_build = seconds([&]() {external.reset(new external_type(input, directory, 3, options));});
+  cout << "  build: " << fixed << setprecision(4) << external_build << " s into " << external->subtrees()
+       << " subtrees (in memory: " << build << " s, " << setprecision(2) << build / external_build << "x)" << endl;
+
+  size_t hits = 0, external_hits = 0;
+  auto loop = seconds([&]() {
+                        for (auto &box : boxes) hits += tree->count(box);
+                      });
+  auto external_loop = seconds([&]() {
+                                 for (auto &box : boxes) external_hits += external->count(box);
+                               });
+  report("loop over count, in memory", boxes.size(), loop, loop);
+  report("loop over count, external", boxes.size(), external_loop, loop);
+  if (hits != external_hits) cout << "  MISMATCH: " << external_hits << " vs " << hits << endl;
+  cout << endl;
+
+  for (size_t k = 0; k < external->subtrees(); ++k)
+    remove((directory + "/subtree-" + to_string(k) + ".kdt").c_str());
+  remove((directory + "/index.kdx").c_str());
+  rmdir(directory.c_str());
+  remove(input.c_str());
+}
+
+
+// builds of inputs with many repeated keys, against uniform keys
+void duplicates_benchmark (const size_t &n, mt19937_64 &gen)
+{
+  cout << "repeated keys (std::array<double, 3> keys):" << endl;
+
+  // Zipf-distributed cells of a 16 x 16 x 16 grid (exponent 1.1)
+  const size_t cells = 16 * 16 * 16;
+  vector<double> cdf(cells);
+  double total = 0;
+  for (size_t c = 0; c < cells; ++c) cdf[c] = total += 1 / pow(c + 1, 1.1);
+
+  uniform_real_distribution<double> uniform(0, 1);
+  vector<pair<array<double, 3>, int>> inputs[4];
+  const char *names[4] = { "uniform", "quantized to 64^3", "Zipf over 16^3", "all equal" };
+  for (auto &input : inputs) input.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    auto cell = min<size_t>(lower_bound(cdf.begin(), cdf.end(), uniform(gen) * total) - cdf.begin(), cells - 1);
+    inputs[0][i] = { { { uniform(gen), uniform(gen), uniform(gen) } }, static_cast<int>(i) };
+    inputs[1][i] = { { { floor(64 * uniform(gen)), floor(64 * uniform(gen)), floor(64 * uniform(gen)) } },
+                     static_cast<int>(i) };
+    inputs[2][i] = { { { double(cell % 16), double(cell / 16 % 16), double(cell / 256) } }, static_cast<int>(i) };
+    inputs[3][i] = { { { 0.5, 0.5, 0.5 } }, static_cast<int>(i) };
+  }
+
+  double uniform_build = 0;
+  for (size_t k = 0; k < 4; ++k) {
+    size_t keys  = 0;
+    auto   build = seconds([&]() {keys = fixed_type(inputs[k].begin(), inputs[k].end(), 3).size();});
+    if (k == 0) uniform_build = build;
+    cout << "  " << left << setw(34) << names[k] << right
+         << setw(10) << fixed << setprecision(4) << build << " s"
+         << setw(14) << keys << " keys     "
+         << setw(8) << setprecision(2) << uniform_build / build << "x" << endl;
+  }
+  cout << endl;
+}
+
+
+int main (int argc, const char *argv[])
+{
+  const size_t n       = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+  const size_t queries = argc > 2 ? strtoul(argv[2], nullptr, 10) : 10000;
+  const size_t threads = argc > 3 ? strtoul(argv[3], nullptr, 10) : 4;
+  const size_t dim     = 3;
+  mt19937_64   gen(2016);
+
+  cout << "k-D tree benchmark: " << n << " points, " << dim << " dimensions\n" << endl;
+
+  auto points = uniform_points(n, dim, gen);
+  unique_ptr<tree_type> tree;
+  auto build = seconds([&]() {tree.reset(new tree_type(points.begin(), points.end(), dim));});
+  cout << "build: " << fixed << setprecision(4) << build << " s\n" << endl;
+
+  copy_benchmark(*tree, points, build);
+
+  auto boxes = uniform_boxes(queries, dim, 0.05, gen);
+  batch_benchmark(*tree, boxes, threads);
+  bounds_benchmark(*tree, points, boxes, uniform_boxes(queries / 10, dim, 0.4, gen));
+
+  vector<pair<array<double, 3>, int>> fixed_points(n);
+  for (size_t i = 0; i < n; ++i) {
+    copy(points[i].first.begin(), points[i].first.end(), fixed_points[i].first.begin());
+    fixed_points[i].second = points[i].second;
+  }
+  unique_ptr<fixed_type> fixed_tree;
+  cout << "std::array<double, 3> keys:" << endl;
+  auto fixed_build = seconds([&]() {fixed_tree.reset(new fixed_type(fixed_points.begin(), fixed_points.end(), dim));});
+  cout << "  build: " << fixed << setprecision(4) << fixed_build << " s ("
+       << setprecision(2) << build / fixed_build << "x)" << endl;
+  size_t hits = 0, fixed_hits = 0;
+  auto loop = seconds([&]() {
+                        for (auto &box : boxes) hits += tree->count(box);
+                      });
+  auto fixed_loop = seconds([&]() {
+                              for (auto &box : boxes) fixed_hits += fixed_tree->count(box);
+                            });
+  report("loop over count", boxes.size(), fixed_loop, loop);
+  if (hits != fixed_hits) cout << "  MISMATCH: " << hits << " vs " << fixed_hits << endl;
+  cout << endl;
+
+  cout << "arena storage (std::array<double, 3> keys):" << endl;
+  auto heap_destroy = seconds([&]() {fixed_tree.reset();});
+  Analysis::kd_arena_resource arena(arena_type::storage_bytes(n, dim));
+  unique_ptr<arena_type> arena_tree;
+  auto arena_build = seconds([&]() {
+                               arena_tree.reset(new arena_type(fixed_points.begin(), fixed_points.end(), dim,
+                                                               Analysis::kd_tree_options(), &arena));
+                             });
+  auto arena_destroy = seconds([&]() {arena_tree.reset(); arena.release();});
+  cout << "  build: " << fixed << setprecision(4) << arena_build << " s ("
+       << setprecision(2) << fixed_build / arena_build << "x), destroy: "
+       << setprecision(6) << arena_destroy << " s (heap: " << heap_destroy << " s)\n" << endl;
+
+  dynamic_benchmark(fixed_points, boxes);
+  concurrent_benchmark(fixed_points, boxes, threads);
+  radius_benchmarks(fixed_points, queries, gen);
+  join_benchmark(fixed_points, threads, gen);
+  external_benchmark(fixed_points, boxes);
+  splits_benchmark(n, queries, gen);
+  duplicates_benchmark(n, gen);
+  encoded_benchmark(n / 10, queries, gen);
+
+  return 0;
+} // main
@@ -0,0 +1,321 @@
+// compile with
+// clang++ -std=c++11 -O2 -march=native -pthread -I. -Wall src/harness.cpp -o bin/kD-tree-harness
+// (add -DKD_TREE_STATS to report the work done per query)
+//
+// usage: kD-tree-harness [--n N] [--dim D] [--queries Q] [--selectivity S]
+//                        [--workload uniform|clustered|zipf|highdim|all]
+//                        [--high-dim D] [--k K] [--leaf L] [--threads T]
+//                        [--bounds] [--seed S]
+
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <memory>
+#include <array>
+#include <fstream>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include <sys/resource.h>
+
+#include "kd_tree/kd_tree.h"
+
+using namespace std;
+
+
+struct settings {
+  size_t   n { 1000000 };
+  size_t   dim { 3 };
+  size_t   queries { 10000 };
+  double   selectivity { 1e-4 };  // expected fraction of the keys in a box
+  string   workload { "all" };
+  size_t   high_dim { 16 };
+  size_t   k { 10 };
+  uint64_t seed { 2016 };
+  Analysis::kd_tree_options options;
+};
+
+
+// ///////////////////////////
+// peak resident memory: VmHWM, which writing 5 to clear_refs resets (Linux);
+// elsewhere the peak of the whole run
+
+void reset_peak_memory ()
+{
+  ofstream("/proc/self/clear_refs") << "5";
+}
+
+size_t peak_memory_kib ()
+{
+  ifstream status("/proc/self/status");
+  string   line;
+  while (getline(status, line))
+    if (line.compare(0, 6, "VmHWM:") == 0) return strtoul(line.c_str() + 6, nullptr, 10);
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return static_cast<size_t>(usage.ru_maxrss);
+}
+// ///////////////////////////
+
+
+// ///////////////////////////
+// generators: points in the unit cube, with consecutive values
+
+using points_type = vector<pair<vector<double>, int>>;
+
+points_type uniform_points (const size_t &n, const size_t &dim, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0, 1);
+  points_type points(n);
+  for (size_t i = 0; i < n; ++i) {
+    points[i].first.resize(dim);
+    for (auto &c : points[i].first) c = uniform(gen);
+    points[i].second = static_cast<int>(i);
+  }
+  return points;
+}
+
+// 32 gaussian clusters of width 0.02 around uniform centers
+points_type clustered_points (const size_t &n, const size_t &dim, mt19937_64 &gen)
+{
+  uniform_real_distribution<double> uniform(0, 1);
+  normal_distribution<double>       spread(0, 0.02);
+  vector<vector<double>> centers(32, vector<double>(dim));
+  for (auto &center : centers)
+    for (auto &c : center) c = uniform(gen);
+
+  uniform_int_distribution<size_t> cluster(0, centers.size() - 1);
+  points_type points(n);
+  for (size_t i = 0; i < n; ++i) {
+    const auto &center = centers[cluster(gen)];
+    points[i].first.resize(dim);
+    for (size_t d = 0; d < dim; ++d) points[i].first[d] = min(max(center[d] + spread(gen), 0.), 1.);
+    points[i].second = static_cast<int>(i);
+  }
+  return points;
+}
+
+// n / 100 distinct uniform keys drawn with Zipf (exponent 1.1) frequencies,
+// so that most keys are repeated (the tree keeps one pair per key)
+points_type zipf_points (const size_t &n, const size_t &dim, mt19937_64 &gen)
+{
+  const auto distinct = uniform_points(max<size_t>(n / 100, 1), dim, gen);
+  vector<double> cdf(distinct.size());
+  double total = 0;
+  for (size_t r = 0; r < cdf.size(); ++r) cdf[r] = total += 1 / pow(r + 1, 1.1);
+
+  uniform_real_distribution<double> uniform(0, 1);
+  points_type points(n);
+  for (size_t i = 0; i < n; ++i) {
+    auto r = min<size_t>(lower_bound(cdf.begin(), cdf.end(), uniform(gen) * total) - cdf.begin(), cdf.size() - 1);
+    points[i] = { distinct[r].first, static_cast<int>(i) };
+  }
+  return points;
+}
+// ///////////////////////////
+
+
+void assign (vector<double> &key, const vector<double> &coords)
+{
+  key = coords;
+}
+
+template<size_t D>
+void assign (array<double, D> &key, const vector<double> &coords)
+{
+  copy(coords.begin(), coords.end(), key.begin());
+}
+
+
+struct latencies {
+  double total { 0 };
+  vector<double> each;
+
+  double percentile (const double &p) {
+    if (each.empty()) return 0;
+    sort(each.begin(), each.end());
+    return each[min<size_t>(static_cast<size_t>(p * each.size()), each.size() - 1)];
+  }
+};
+
+// times every query separately
+template<class Function>
+latencies time_queries (const size_t &queries, Function f)
+{
+  latencies result;
+  result.each.reserve(queries);
+  auto start = chrono::steady_clock::now();
+  for (size_t q = 0; q < queries; ++q) {
+    auto before = chrono::steady_clock::now();
+    f(q);
+    result.each.push_back(chrono::duration<double>(chrono::steady_clock::now() - before).count());
+  }
+  result.total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+
+void report_queries (const string &name, latencies times, const double &hits, const size_t &queries)
+{
+  cout << "  " << left << setw(10) << name << right
+       << setw(12) << fixed << setprecision(0) << queries / times.total << " queries/s"
+       << "   p50 " << setw(9) << setprecision(2) << times.percentile(0.5) * 1e6 << " us"
+       << "   p99 " << setw(9) << times.percentile(0.99) * 1e6 << " us"
+       << "   " << setw(10) << setprecision(1) << hits / queries << " hits/query" << endl;
+
+  if (Analysis::kd_stats_enabled) {
+    auto &stats = Analysis::kd_stats();
+    cout << "  " << setw(10) << "" << setprecision(1)
+         << " per query: " << double(stats.nodes_visited) / queries << " nodes visited, "
+         << double(stats.leaves_tested) / queries << " leaves tested, "
+         << double(stats.keys_tested) / queries << " keys tested, "
+         << double(stats.subtrees_pruned) / queries << " subtrees pruned, "
+         << double(stats.subtrees_taken) / queries << " taken whole" << endl;
+  }
+}
+
+
+template<class Tree, class Key>
+void run (const string &name, const points_type &points, const size_t &dim, const settings &config,
+          mt19937_64 &gen)
+{
+  vector<pair<Key, int>> input(points.size());
+  for (size_t i = 0; i < points.size(); ++i) {
+    assign(input[i].first, points[i].first);
+    input[i].second = points[i].second;
+  }
+
+  reset_peak_memory();
+  const size_t before = peak_memory_kib();
+  unique_ptr<Tree> tree;
+  auto start = chrono::steady_clock::now();
+  tree.reset(new Tree(input.begin(), input.end(), dim, config.options));
+  const double build = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  const size_t peak  = peak_memory_kib();
+
+  auto histogram = tree->depth_histogram();
+  size_t leaves = 0, depths = 0, shallowest = histogram.size();
+  for (size_t d = 0; d < histogram.size(); ++d) {
+    leaves += histogram[d];
+    depths += d * histogram[d];
+    if (histogram[d] != 0 && shallowest == histogram.size()) shallowest = d;
+  }
+
+  cout << name << ": " << points.size() << " points, " << tree->size() << " keys, " << dim << " dimensions" << endl;
+  cout << "  build      " << setw(12) << fixed << setprecision(0) << points.size() / build << " points/s"
+       << "   " << setprecision(4) << build << " s   peak memory " << peak / 1024 << " MiB ("
+       << (peak > before ? peak - before : 0) / 1024 << " MiB for the build)" << endl;
+  cout << "  leaves     " << setw(12) << leaves << "           depth " << setprecision(1)
+       << double(depths) / max<size_t>(leaves, 1) << " on average; leaves at depths "
+       << shallowest << " to " << histogram.size() - 1 << ":";
+  for (size_t d = shallowest; d < histogram.size(); ++d) cout << " " << histogram[d];
+  cout << endl;
+
+  // boxes around keys of the data, with sides for the selectivity in a
+  // uniform cube
+  const double side = pow(config.selectivity, 1. / dim);
+  uniform_int_distribution<size_t> pick(0, points.size() - 1);
+  vector<vector<pair<double, double>>> boxes(config.queries, vector<pair<double, double>>(dim));
+  vector<Key> centers(boxes.size());
+  for (size_t q = 0; q < boxes.size(); ++q) {
+    const auto &center = points[pick(gen)].first;
+    for (size_t d = 0; d < dim; ++d) boxes[q][d] = { center[d] - side / 2, center[d] + side / 2 };
+    assign(centers[q], center);
+  }
+
+  double hits = 0;
+  Analysis::kd_stats().reset();
+  auto box_times = time_queries(boxes.size(), [&](const size_t &q) {hits += tree->count(boxes[q]);});
+  report_queries("box", box_times, hits, boxes.size());
+
+  hits = 0;
+  Analysis::kd_stats().reset();
+  auto knn_times = time_queries(centers.size(), [&](const size_t &q) {
+                                  hits += tree->nearest(centers[q], config.k).size();
+                                });
+  report_queries(to_string(config.k) + "-nn", knn_times, hits, centers.size());
+  cout << endl;
+}
+
+
+// fixed-size keys for the common dimensions, std::vector otherwise
+void run_dim (const string &name, const points_type &points, const size_t &dim, const settings &config,
+              mt19937_64 &gen)
+{
+  switch (dim) {
+  case 2:  run<Analysis::fixed_kd_tree<double, 2, int>, array<double, 2>>(name, points, dim, config, gen); break;
+  case 3:  run<Analysis::fixed_kd_tree<double, 3, int>, array<double, 3>>(name, points, dim, config, gen); break;
+  case 4:  run<Analysis::fixed_kd_tree<double, 4, int>, array<double, 4>>(name, points, dim, config, gen); break;
+  case 8:  run<Analysis::fixed_kd_tree<double, 8, int>, array<double, 8>>(name, points, dim, config, gen); break;
+  case 16: run<Analysis::fixed_kd_tree<double, 16, int>, array<double, 16>>(name, points, dim, config, gen); break;
+  default: run<Analysis::kd_tree<vector<double>, int>, vector<double>>(name, points, dim, config, gen);
+  }
+}
+
+
+settings parse (int argc, const char *argv[])
+{
+  settings config;
+  for (int i = 1; i < argc; ++i) {
+    const string flag = argv[i];
+    if (flag == "--bounds") {
+      config.options.bounding_boxes = true;
+      continue;
+    }
+    if (i + 1 == argc) throw invalid_argument("missing value for " + flag);
+    const string value = argv[++i];
+    if (flag == "--n") config.n = stoul(value);
+    else if (flag == "--dim") config.dim = stoul(value);
+    else if (flag == "--queries") config.queries = stoul(value);
+    else if (flag == "--selectivity") config.selectivity = stod(value);
+    else if (flag == "--workload") config.workload = value;
+    else if (flag == "--high-dim") config.high_dim = stoul(value);
+    else if (flag == "--k") config.k = stoul(value);
+    else if (flag == "--leaf") config.options.leaf_size = stoul(value);
+    else if (flag == "--threads") config.options.threads = stoul(value);
+    else if (flag == "--seed") config.seed = stoull(value);
+    else throw invalid_argument("unknown option " + flag);
+  }
+  if (config.n == 0 || config.dim == 0 || config.high_dim == 0)
+    throw invalid_argument("--n, --dim and --high-dim must be positive");
+  return config;
+}
+
+
+int main (int argc, const char *argv[])
+{
+  settings config;
+  try {
+    config = parse(argc, argv);
+  }
+  catch (exception &e) {
+    cerr << e.what() << endl;
+    return 1;
+  }
+
+  mt19937_64 gen(config.seed);
+  const bool all = config.workload == "all";
+
+  cout << "k-D tree harness: " << config.queries << " queries of selectivity " << config.selectivity
+       << ", leaf size " << config.options.leaf_size
+       << (config.options.bounding_boxes ? ", bounding boxes" : "")
+       << (Analysis::kd_stats_enabled ? ", stats" : "") << "\n" << endl;
+
+  if (all || config.workload == "uniform")
+    run_dim("uniform", uniform_points(config.n, config.dim, gen), config.dim, config, gen);
+  if (all || config.workload == "clustered")
+    run_dim("clustered", clustered_points(config.n, config.dim, gen), config.dim, config, gen);
+  if (all || config.workload == "zipf")
+    run_dim("zipf duplicates", zipf_points(config.n, config.dim, gen), config.dim, config, gen);
+  if (all || config.workload == "highdim")
+    run_dim("high-dimensional uniform", uniform_points(config.n, config.high_dim, gen), config.high_dim, config, gen);
+
+  return 0;
+} // main
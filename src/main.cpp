@@ -1,167 +1,17 @@
 // compile with
-// clang++ -std=c++11 -I. -Wall src/main.cpp -o bin/kD-tree
+// clang++ -std=c++11 -pthread -I. -Wall src/main.cpp -o bin/kD-tree
 
 
 #include <iostream>
 #include <iterator>
 #include <vector>
+#include <random>
+#include <cmath>
+#include <array>
+#include <cstdio>
 
 #include "kd_tree/kd_tree.h"
-
-// ///////////////////////////
-#include <type_traits>
-#include <utility>
-#include <string>
-
-class VarBase
-{
-public:
-  enum class Type {Bool,
-                   Float, Double,
-                   Int, Unsigned,
-                   Long, UnsignedLong,
-                   Char, UnsignedChar,
-                   String,
-                   Unknown};
-
-  VarBase (Type &&type) : m_type(std::move(type)) {}
-  VarBase (const Type &type) : m_type(type) {}
-  virtual ~VarBase () {}
-
-  const Type& GetType () const {return m_type;}
-
-protected:
-  Type m_type;
-};
-
-
-struct VarBaseSortable : public VarBase
-{
-  VarBaseSortable (Type &&type) : VarBase(std::move(type)) {}
-  VarBaseSortable (const Type &type) : VarBase(type) {}
-  virtual ~VarBaseSortable () {}
-
-  virtual bool operator< (const VarBaseSortable&) const = 0;
-  virtual bool operator== (const VarBaseSortable&) const = 0;
-
-  struct Less
-  {
-    bool operator() (const VarBaseSortable *lhs, const VarBaseSortable *rhs) const {return (*lhs < *rhs);}
-  };
-
-  struct Equate
-  {
-    bool operator() (const VarBaseSortable *lhs, const VarBaseSortable *rhs) const {return (*lhs == *rhs);}
-  };
-};
-
-
-
-
-template <class T>
-class Var : public VarBaseSortable
-{
-  T m_value;
-
-public:
-  Var (T &&val) :
-    VarBaseSortable(std::is_same<T, bool>::value ? VarBase::Type::Bool :
-                    std::is_same<T, float>::value ? VarBase::Type::Float :
-                    std::is_same<T, double>::value ? VarBase::Type::Double :
-                    std::is_same<T, int>::value ? VarBase::Type::Int :
-                    std::is_same<T, unsigned>::value ? VarBase::Type::Unsigned :
-                    std::is_same<T, long>::value ? VarBase::Type::Long :
-                    std::is_same<T, unsigned long>::value ? VarBase::Type::UnsignedLong :
-                    std::is_same<T, char>::value ? VarBase::Type::Char :
-                    std::is_same<T, unsigned char>::value ? VarBase::Type::UnsignedChar :
-                    VarBase::Type::Unknown),
-    m_value(std::move(val)) {}
-  Var (const T &val) :
-    VarBaseSortable(std::is_same<T, bool>::value ? VarBase::Type::Bool :
-                    std::is_same<T, float>::value ? VarBase::Type::Float :
-                    std::is_same<T, double>::value ? VarBase::Type::Double :
-                    std::is_same<T, int>::value ? VarBase::Type::Int :
-                    std::is_same<T, unsigned>::value ? VarBase::Type::Unsigned :
-                    std::is_same<T, long>::value ? VarBase::Type::Long :
-                    std::is_same<T, unsigned long>::value ? VarBase::Type::UnsignedLong :
-                    std::is_same<T, char>::value ? VarBase::Type::Char :
-                    std::is_same<T, unsigned char>::value ? VarBase::Type::UnsignedChar :
-                    VarBase::Type::Unknown),
-    m_value(val) {}
-  virtual ~Var () {}
-
-  T& Value () {return m_value;}
-  const T& Value () const {return m_value;}
-
-  operator T () {return m_value;}
-  operator const T () const {return m_value;}
-
-  virtual bool operator< (const VarBaseSortable &rhs) const
-  {
-    if (rhs.GetType() == VarBase::Type::Bool) return (m_value < static_cast<const Var<bool>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Float) return (m_value < static_cast<const Var<float>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Double) return (m_value < static_cast<const Var<double>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Int) return (m_value < static_cast<const Var<int>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Unsigned) return (static_cast<const unsigned>(m_value) < static_cast<const Var<unsigned>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Long) return (m_value < static_cast<const Var<long>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::UnsignedLong) return (static_cast<const unsigned long>(m_value) < static_cast<const Var<unsigned long>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Char) return (m_value < static_cast<const Var<char>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::UnsignedChar) return (static_cast<const unsigned char>(m_value) < static_cast<const Var<unsigned char>&>(rhs));
-    return false;
-  }
-
-  virtual bool operator== (const VarBaseSortable &rhs) const
-  {
-    if (rhs.GetType() == VarBase::Type::Bool) return (m_value == static_cast<const Var<bool>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Float) return (m_value == static_cast<const Var<float>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Double) return (m_value == static_cast<const Var<double>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Int) return (m_value == static_cast<const Var<int>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Unsigned) return (static_cast<const unsigned>(m_value) == static_cast<const Var<unsigned>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Long) return (m_value == static_cast<const Var<long>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::UnsignedLong) return (static_cast<const unsigned long>(m_value) == static_cast<const Var<unsigned long>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::Char) return (m_value == static_cast<const Var<char>&>(rhs));
-    if (rhs.GetType() == VarBase::Type::UnsignedChar) return (static_cast<const unsigned char>(m_value) == static_cast<const Var<unsigned char>&>(rhs));
-    return false;
-  }
-
-};
-
-template <>
-class Var<std::string> : public VarBaseSortable
-{
-  std::string m_value;
-
-public:
-  Var (std::string &&val) :
-    VarBaseSortable(VarBase::Type::String),
-    m_value(std::move(val)) {}
-  Var (std::string &val) :
-    VarBaseSortable(VarBase::Type::String),
-      m_value(val) {}
-  virtual ~Var () {}
-
-  std::string& Value () {return m_value;}
-  const std::string& Value () const {return m_value;}
-
-  virtual bool operator< (const VarBaseSortable &rhs) const
-  {
-    // using dynamic_cast instead of static_cast in case someone else needs a
-    // different specialization for VarBase::Type::String (e.g. const char*)
-    if (rhs.GetType() == VarBase::Type::String)
-      return (m_value < dynamic_cast<const Var<std::string>&>(rhs).Value());
-    return false;
-  }
-
-  virtual bool operator== (const VarBaseSortable &rhs) const
-  {
-    // using dynamic_cast instead of static_cast in case someone else needs a
-    // different specialization for VarBase::Type::String (e.g. const char*)
-    if (rhs.GetType() == VarBase::Type::String)
-      return (m_value == dynamic_cast<const Var<std::string>&>(rhs).Value());
-    return false;
-  }
-};
-// ///////////////////////////
+#include "var.h"
 
 
 using namespace std;
@@ -196,7 +46,7 @@ int main (int argc, const char *argv[])
   {
     Analysis::kd_tree<vector<double>, int> tree(points.begin(), points.end(), 3);
     cout << "# of elements in tree: " << std::distance(tree.begin(), tree.end()) << endl;
-    cout << "elements of tree in reverse sorted order: ";
+    cout << "elements of tree in leaf order: ";
     for (auto p : tree) cout << p.get().second << " ";
     cout << "\n" << endl;
 
@@ -211,7 +61,7 @@ int main (int argc, const char *argv[])
     // NOTE: one must create a new container for the contained points if you are to use them as input to a kD-tree
     vector < pair < vector<double>, int >> contained_points;
     cout << "# of contained elements: " << std::distance(contained.begin(), contained.end()) << endl;
-    cout << "contained elements of tree in reverse sorted order: ";
+    cout << "contained elements of tree in leaf order: ";
     for (auto p : contained) {
       cout << p.get().second << " ";
       contained_points.emplace_back(p.get());
@@ -221,64 +71,194 @@ int main (int argc, const char *argv[])
     Analysis::kd_tree<vector<double>, int> tree2(contained_points.begin(), contained_points.end(), 3);
     cout << "# of elements in newly constructed tree from contained points: " <<
       std::distance(tree2.begin(), tree2.end()) << endl;
-    cout << "elements of tree in reverse sorted order: ";
+    cout << "elements of tree in leaf order: ";
     for (auto p : tree2) cout << p.get().second << " ";
     cout << "\n" << endl;
 
     Analysis::kd_tree<vector<double>, int> tree_copy(tree);
     cout << "# of elements in copied tree: " << std::distance(tree.begin(), tree.end()) << endl;
-    cout << "elements of copied tree in reverse sorted order: ";
+    cout << "elements of copied tree in leaf order: ";
     for (auto p : tree) cout << p.get().second << " ";
     cout << "\n\n" << endl;
   }
   // ///////////////////////////
 
 
-  // // ///////////////////////////
-  // {
-  //   cout << "Using custom class as coordinate variables (same coordinates):" << endl;
-  //   vector<vector<VarBaseSortable*>> data = {{new Var<double>(10), new Var<int>(1), new Var<string>("1")},
-  //                                       {new Var<double>(8), new Var<int>(3), new Var<string>("3")},
-  //                                       {new Var<double>(1), new Var<int>(3), new Var<string>("3")},
-  //                                       {new Var<double>(5), new Var<int>(5), new Var<string>("5")},
-  //                                       {new Var<double>(1), new Var<int>(4), new Var<string>("4")},
-  //                                       {new Var<double>(7), new Var<int>(2), new Var<string>("2")},
-  //                                       {new Var<double>(3), new Var<int>(4), new Var<string>("4")},
-  //                                       {new Var<double>(2), new Var<int>(2), new Var<string>("2")}};
-  //   vector < pair < vector<VarBaseSortable*>, int >> points_ptrs { { { data[0][0], data[0][1], data[0][2] }, 1 },
-  //                                                             { { data[1][0], data[1][1], data[1][2] }, 2 },
-  //                                                             { { data[2][0], data[2][1], data[2][2] }, 3 },
-  //                                                             { { data[3][0], data[3][1], data[3][2] }, 4 },
-  //                                                             { { data[4][0], data[4][1], data[4][2] }, 5 },
-  //                                                             { { data[5][0], data[5][1], data[5][2] }, 6 },
-  //                                                             { { data[6][0], data[6][1], data[6][2] }, 7 },
-  //                                                             { { data[7][0], data[7][1], data[7][2] }, 8 } };
-  //   Analysis::kd_tree<vector<VarBaseSortable*>, int,
-  //                     VarBaseSortable::Less, VarBaseSortable::Equate> tree(points_ptrs.begin(), points_ptrs.end(), 3);
-  //
-  //   cout << "# of elements in tree: " << std::distance(tree.begin(), tree.end()) << endl;
-  //   cout << "elements of tree in reverse sorted order: ";
-  //   for (auto p : tree) cout << p.get().second << " ";
-  //   cout << "\n" << endl;
-  //
-  //   vector < pair < VarBaseSortable*, VarBaseSortable* >> constraints = { { new Var<double>(4), new Var<double>(8) },
-  //                                                                             { new Var<int>(1), new Var<int>(5) },
-  //                                                                             { new Var<string>("1"), new Var<string>("3") } };
-  //   auto contained = tree[constraints];
-  //   cout << "# of contained elements: " << std::distance(contained.begin(), contained.end()) << endl;
-  //   cout << "contained elements of tree in reverse sorted order: ";
-  //   for (auto p : contained) cout << p.get().second << " ";
-  //   cout << endl;
-  //
-  //   for (auto &v : data)
-  //     for (auto &e : v)
-  //       delete e;
-  //   for (auto &p : constraints) {
-  //     delete p.first;
-  //     delete p.second;
-  //   }
-  // }
-  // // ///////////////////////////
+  // ///////////////////////////
+  {
+    cout << "k nearest neighbours compared to a brute-force search:" << endl;
+    std::mt19937 gen(12345);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    vector < pair < vector<double>, int >> random_points;
+    for (int i = 0; i < 10000; ++i)
+      random_points.push_back({ { uniform(gen), uniform(gen), uniform(gen) }, i });
+
+    vector < pair < vector<double>, int >> input(random_points);
+    Analysis::kd_tree<vector<double>, int> tree(input.begin(), input.end(), 3);
+
+    auto distance = [](const vector<double> &a, const vector<double> &b) {
+                      double d2 = 0;
+                      for (size_t i = 0; i < a.size(); ++i) d2 += (a[i] - b[i]) * (a[i] - b[i]);
+                      return std::sqrt(d2);
+                    };
+    const size_t k = 10;
+    size_t mismatches = 0;
+    for (int q = 0; q < 100; ++q) {
+      vector<double> point { uniform(gen), uniform(gen), uniform(gen) };
+      auto found = tree.nearest(point, k);
+
+      vector<double> distances;
+      for (auto &p : random_points) distances.push_back(distance(p.first, point));
+      std::partial_sort(distances.begin(), distances.begin() + k, distances.end());
+
+      for (size_t i = 0; i < k; ++i)
+        if (i >= found.size() || distance(found[i].get().first, point) != distances[i]) ++mismatches;
+    }
+    cout << "# of mismatched neighbours in 100 searches for the " << k << " nearest: " << mismatches << "\n" << endl;
+  }
+  // ///////////////////////////
+
+
+  // ///////////////////////////
+  {
+    cout << "tree saved to a file and mapped back:" << endl;
+    std::mt19937 gen(2718);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    vector < pair < std::array<double, 3>, int >> random_points;
+    for (int i = 0; i < 10000; ++i)
+      random_points.push_back({ { { uniform(gen), uniform(gen), uniform(gen) } }, i });
+
+    using tree_type = Analysis::fixed_kd_tree<double, 3, int>;
+    tree_type tree(random_points.begin(), random_points.end(), 3);
+    tree.save("kD-tree-demo.kdt");
+    auto mapped = tree_type::open("kD-tree-demo.kdt");
+
+    size_t mismatches = 0;
+    for (int q = 0; q < 100; ++q) {
+      double x = uniform(gen), y = uniform(gen), z = uniform(gen);
+      vector < pair < double, double >> box { { x, x + 0.2 }, { y, y + 0.2 }, { z, z + 0.2 } };
+      vector<int> expected, found;
+      for (auto p : tree[box]) expected.push_back(p.get().second);
+      for (auto p : mapped[box]) found.push_back(p.get().second);
+      if (expected != found) ++mismatches;
+    }
+    cout << "# of elements in mapped tree: " << mapped.size() << endl;
+    cout << "# of mismatched queries: " << mismatches << "\n" << endl;
+    std::remove("kD-tree-demo.kdt");
+  }
+  // ///////////////////////////
+
+
+  // ///////////////////////////
+  {
+    cout << "Using custom class as coordinate variables (same coordinates):" << endl;
+    vector<vector<VarBaseSortable*>> data = {{new Var<double>(10), new Var<int>(1), new Var<string>("1")},
+                                             {new Var<double>(8), new Var<int>(3), new Var<string>("3")},
+                                             {new Var<double>(1), new Var<int>(3), new Var<string>("3")},
+                                             {new Var<double>(5), new Var<int>(5), new Var<string>("5")},
+                                             {new Var<double>(1), new Var<int>(4), new Var<string>("4")},
+                                             {new Var<double>(7), new Var<int>(2), new Var<string>("2")},
+                                             {new Var<double>(3), new Var<int>(4), new Var<string>("4")},
+                                             {new Var<double>(2), new Var<int>(2), new Var<string>("2")}};
+    vector < pair < vector<VarBaseSortable*>, int >> points_ptrs;
+    for (size_t i = 0; i < data.size(); ++i) points_ptrs.push_back({ data[i], static_cast<int>(i + 1) });
+    Analysis::kd_tree<vector<VarBaseSortable*>, int,
+                      VarBaseSortable::Less, VarBaseSortable::Equate> tree(points_ptrs.begin(), points_ptrs.end(), 3);
+
+    cout << "# of elements in tree: " << std::distance(tree.begin(), tree.end()) << endl;
+    cout << "elements of tree in leaf order: ";
+    for (auto p : tree) cout << p.get().second << " ";
+    cout << "\n" << endl;
+
+    vector < pair < VarBaseSortable*, VarBaseSortable* >> constraints = { { new Var<double>(4), new Var<double>(8) },
+                                                                          { new Var<int>(1), new Var<int>(5) },
+                                                                          { new Var<string>("1"), new Var<string>("3") } };
+    auto contained = tree[constraints];
+    cout << "# of contained elements: " << std::distance(contained.begin(), contained.end()) << endl;
+    cout << "contained elements of tree in leaf order: ";
+    for (auto p : contained) cout << p.get().second << " ";
+    cout << "\n" << endl;
+
+    // the same records and query on order-preserving integer codes
+    cout << "Same coordinates encoded as integers:" << endl;
+    VarEncoder encoder(data.begin(), data.end());
+    vector < pair < std::array<Analysis::kd_code, 3>, int >> encoded;
+    for (auto &p : points_ptrs) {
+      std::array<Analysis::kd_code, 3> key;
+      for (size_t d = 0; d < 3; ++d) key[d] = encoder.Encode(p.first[d], d);
+      encoded.push_back({ key, p.second });
+    }
+    Analysis::fixed_kd_tree<Analysis::kd_code, 3, int> encoded_tree(encoded.begin(), encoded.end(), 3);
+
+    vector < pair < Analysis::kd_code, Analysis::kd_code >> encoded_constraints;
+    for (size_t d = 0; d < 3; ++d)
+      encoded_constraints.push_back(encoder.EncodeBounds(constraints[d].first, constraints[d].second, d));
+    auto encoded_contained = encoded_tree[encoded_constraints];
+    cout << "# of contained elements: " << std::distance(encoded_contained.begin(), encoded_contained.end()) << endl;
+    cout << "contained elements (decoded coordinates):" << endl;
+    for (auto p : encoded_contained) {
+      cout << p.get().second << ": ";
+      cout << static_cast<Var<double>&>(*encoder.Decode(p.get().first[0], 0)).Value() << " ";
+      cout << static_cast<Var<int>&>(*encoder.Decode(p.get().first[1], 1)).Value() << " ";
+      cout << static_cast<Var<string>&>(*encoder.Decode(p.get().first[2], 2)).Value() << "\n";
+    }
+    cout << endl;
+
+    for (auto &v : data)
+      for (auto &e : v)
+        delete e;
+    for (auto &p : constraints) {
+      delete p.first;
+      delete p.second;
+    }
+  }
+  // ///////////////////////////
+
+
+  // ///////////////////////////
+  {
+    cout << "Coordinate mixing numeric types (int, double, long), encoded as doubles:" << endl;
+    vector<vector<VarBaseSortable*>> data = {{new Var<int>(1), new Var<int>(1)},
+                                             {new Var<double>(2.5), new Var<int>(2)},
+                                             {new Var<long>(1000000000000L), new Var<int>(3)},
+                                             {new Var<double>(-0.75), new Var<int>(4)},
+                                             {new Var<int>(3), new Var<int>(5)}};
+    VarEncoder encoder(data.begin(), data.end());
+    vector < pair < std::array<Analysis::kd_code, 2>, int >> encoded;
+    for (size_t i = 0; i < data.size(); ++i)
+      encoded.push_back({ { { encoder.Encode(data[i][0], 0), encoder.Encode(data[i][1], 1) } }, static_cast<int>(i + 1) });
+    Analysis::fixed_kd_tree<Analysis::kd_code, 2, int> tree(encoded.begin(), encoded.end(), 2);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < data.size(); ++i)
+      for (size_t d = 0; d < 2; ++d)
+        if (!(*encoder.Decode(encoded[i].first[d], d) == *data[i][d])) ++mismatches;
+    cout << "# of coordinates decoded to a different value: " << mismatches << endl;
+
+    vector < pair < VarBaseSortable*, VarBaseSortable* >> constraints = { { new Var<int>(-1), new Var<double>(2.5) },
+                                                                          { new Var<int>(1), new Var<int>(5) } };
+    vector < pair < Analysis::kd_code, Analysis::kd_code >> encoded_constraints;
+    for (size_t d = 0; d < 2; ++d)
+      encoded_constraints.push_back(encoder.EncodeBounds(constraints[d].first, constraints[d].second, d));
+    auto contained = tree[encoded_constraints];
+    cout << "# of contained elements: " << std::distance(contained.begin(), contained.end()) << endl;
+    cout << "contained elements (decoded coordinates):" << endl;
+    for (auto p : contained) {
+      cout << p.get().second << ": ";
+      cout << static_cast<Var<double>&>(*encoder.Decode(p.get().first[0], 0)).Value() << " ";
+      cout << static_cast<Var<int>&>(*encoder.Decode(p.get().first[1], 1)).Value() << "\n";
+    }
+    cout << endl;
+
+    for (auto &v : data)
+      for (auto &e : v)
+        delete e;
+    for (auto &p : constraints) {
+      delete p.first;
+      delete p.second;
+    }
+  }
+  // ///////////////////////////
 
   return 0;
 } // main
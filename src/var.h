@@ -0,0 +1,409 @@
+#pragma once
+
+// mixed-type coordinate variables, compared through virtual functions, and
+// their encoding as integer keys
+
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+#include "kd_tree/kd_encoding.h"
+
+class VarBase
+{
+public:
+  enum class Type {Bool,
+                   Float, Double,
+                   Int, Unsigned,
+                   Long, UnsignedLong,
+                   Char, UnsignedChar,
+                   String,
+                   Unknown};
+
+  VarBase (Type &&type) : m_type(std::move(type)) {}
+  VarBase (const Type &type) : m_type(type) {}
+  virtual ~VarBase () {}
+
+  const Type& GetType () const {return m_type;}
+
+protected:
+  Type m_type;
+};
+
+
+struct VarBaseSortable : public VarBase
+{
+  VarBaseSortable (Type &&type) : VarBase(std::move(type)) {}
+  VarBaseSortable (const Type &type) : VarBase(type) {}
+  virtual ~VarBaseSortable () {}
+
+  virtual bool operator< (const VarBaseSortable&) const = 0;
+  virtual bool operator== (const VarBaseSortable&) const = 0;
+
+  struct Less
+  {
+    bool operator() (const VarBaseSortable *lhs, const VarBaseSortable *rhs) const {return (*lhs < *rhs);}
+  };
+
+  struct Equate
+  {
+    bool operator() (const VarBaseSortable *lhs, const VarBaseSortable *rhs) const {return (*lhs == *rhs);}
+  };
+};
+
+
+
+
+template <class T>
+class Var : public VarBaseSortable
+{
+  T m_value;
+
+  // compares numbers of different types by value: a negative number is less
+  // than any unsigned one, otherwise both are converted to their common type
+  template <class U>
+  static bool Less (const T &lhs, const U &rhs)
+  {
+    const bool lhsNegative = std::is_signed<T>::value && lhs < T(), rhsNegative = std::is_signed<U>::value && rhs < U();
+    if (lhsNegative != rhsNegative) return lhsNegative;
+    using common_type = typename std::common_type<T, U>::type;
+    return static_cast<common_type>(lhs) < static_cast<common_type>(rhs);
+  }
+
+  template <class U>
+  static bool Equal (const T &lhs, const U &rhs)
+  {
+    const bool lhsNegative = std::is_signed<T>::value && lhs < T(), rhsNegative = std::is_signed<U>::value && rhs < U();
+    if (lhsNegative != rhsNegative) return false;
+    using common_type = typename std::common_type<T, U>::type;
+    return static_cast<common_type>(lhs) == static_cast<common_type>(rhs);
+  }
+
+public:
+  Var (T &&val) :
+    VarBaseSortable(std::is_same<T, bool>::value ? VarBase::Type::Bool :
+                    std::is_same<T, float>::value ? VarBase::Type::Float :
+                    std::is_same<T, double>::value ? VarBase::Type::Double :
+                    std::is_same<T, int>::value ? VarBase::Type::Int :
+                    std::is_same<T, unsigned>::value ? VarBase::Type::Unsigned :
+                    std::is_same<T, long>::value ? VarBase::Type::Long :
+                    std::is_same<T, unsigned long>::value ? VarBase::Type::UnsignedLong :
+                    std::is_same<T, char>::value ? VarBase::Type::Char :
+                    std::is_same<T, unsigned char>::value ? VarBase::Type::UnsignedChar :
+                    VarBase::Type::Unknown),
+    m_value(std::move(val)) {}
+  Var (const T &val) :
+    VarBaseSortable(std::is_same<T, bool>::value ? VarBase::Type::Bool :
+                    std::is_same<T, float>::value ? VarBase::Type::Float :
+                    std::is_same<T, double>::value ? VarBase::Type::Double :
+                    std::is_same<T, int>::value ? VarBase::Type::Int :
+                    std::is_same<T, unsigned>::value ? VarBase::Type::Unsigned :
+                    std::is_same<T, long>::value ? VarBase::Type::Long :
+                    std::is_same<T, unsigned long>::value ? VarBase::Type::UnsignedLong :
+                    std::is_same<T, char>::value ? VarBase::Type::Char :
+                    std::is_same<T, unsigned char>::value ? VarBase::Type::UnsignedChar :
+                    VarBase::Type::Unknown),
+    m_value(val) {}
+  virtual ~Var () {}
+
+  T& Value () {return m_value;}
+  const T& Value () const {return m_value;}
+
+  operator T () {return m_value;}
+  operator const T () const {return m_value;}
+
+  virtual bool operator< (const VarBaseSortable &rhs) const
+  {
+    if (rhs.GetType() == VarBase::Type::Bool) return Less(m_value, static_cast<const Var<bool>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Float) return Less(m_value, static_cast<const Var<float>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Double) return Less(m_value, static_cast<const Var<double>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Int) return Less(m_value, static_cast<const Var<int>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Unsigned) return Less(m_value, static_cast<const Var<unsigned>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Long) return Less(m_value, static_cast<const Var<long>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::UnsignedLong) return Less(m_value, static_cast<const Var<unsigned long>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Char) return Less(m_value, static_cast<const Var<char>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::UnsignedChar) return Less(m_value, static_cast<const Var<unsigned char>&>(rhs).Value());
+    return false;
+  }
+
+  virtual bool operator== (const VarBaseSortable &rhs) const
+  {
+    if (rhs.GetType() == VarBase::Type::Bool) return Equal(m_value, static_cast<const Var<bool>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Float) return Equal(m_value, static_cast<const Var<float>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Double) return Equal(m_value, static_cast<const Var<double>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Int) return Equal(m_value, static_cast<const Var<int>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Unsigned) return Equal(m_value, static_cast<const Var<unsigned>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Long) return Equal(m_value, static_cast<const Var<long>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::UnsignedLong) return Equal(m_value, static_cast<const Var<unsigned long>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::Char) return Equal(m_value, static_cast<const Var<char>&>(rhs).Value());
+    if (rhs.GetType() == VarBase::Type::UnsignedChar) return Equal(m_value, static_cast<const Var<unsigned char>&>(rhs).Value());
+    return false;
+  }
+
+};
+
+template <>
+class Var<std::string> : public VarBaseSortable
+{
+  std::string m_value;
+
+public:
+  Var (std::string &&val) :
+    VarBaseSortable(VarBase::Type::String),
+    m_value(std::move(val)) {}
+  Var (std::string &val) :
+    VarBaseSortable(VarBase::Type::String),
+      m_value(val) {}
+  virtual ~Var () {}
+
+  std::string& Value () {return m_value;}
+  const std::string& Value () const {return m_value;}
+
+  virtual bool operator< (const VarBaseSortable &rhs) const
+  {
+    // using dynamic_cast instead of static_cast in case someone else needs a
+    // different specialization for VarBase::Type::String (e.g. const char*)
+    if (rhs.GetType() == VarBase::Type::String)
+      return (m_value < dynamic_cast<const Var<std::string>&>(rhs).Value());
+    return false;
+  }
+
+  virtual bool operator== (const VarBaseSortable &rhs) const
+  {
+    // using dynamic_cast instead of static_cast in case someone else needs a
+    // different specialization for VarBase::Type::String (e.g. const char*)
+    if (rhs.GetType() == VarBase::Type::String)
+      return (m_value == dynamic_cast<const Var<std::string>&>(rhs).Value());
+    return false;
+  }
+};
+
+
+/**
+ * Encodes records of VarBaseSortable coordinates (one type of value per
+ * coordinate, set by the first record) as Analysis::kd_code keys that sort
+ * like the values, so that the tree builds and queries on plain integers
+ * instead of calling the virtual comparisons
+ * Coordinates whose values are all of one integer type are encoded exactly as
+ * 64-bit signed or unsigned integers, and strings by their rank among the
+ * strings of the records. Other numbers are encoded as doubles, since
+ * VarBaseSortable compares numbers of different types by value: a coordinate
+ * that mixes numeric types decodes as Var<double>, and integers beyond 2^53
+ * there may share a code (and decode to a neighbouring value)
+ */
+class VarEncoder
+{
+  enum class Column {Number, Signed, Unsigned, String};
+
+  std::vector<VarBase::Type> m_types;
+  std::vector<Column> m_columns;
+  std::vector<bool>   m_mixed;  // numbers of several types, decoded as double
+  std::vector<Analysis::kd_string_codes> m_strings;
+
+  static Column ColumnOf (const VarBase::Type &type)
+  {
+    switch (type) {
+    case VarBase::Type::Int: case VarBase::Type::Long: case VarBase::Type::Char:
+      return Column::Signed;
+    case VarBase::Type::Bool: case VarBase::Type::Unsigned: case VarBase::Type::UnsignedLong: case VarBase::Type::UnsignedChar:
+      return Column::Unsigned;
+    case VarBase::Type::String:
+      return Column::String;
+    default:
+      return Column::Number;
+    }
+  }
+
+  static double Number (const VarBaseSortable *v)
+  {
+    switch (v->GetType()) {
+    case VarBase::Type::Bool:         return static_cast<const Var<bool>*>(v)->Value();
+    case VarBase::Type::Float:        return static_cast<const Var<float>*>(v)->Value();
+    case VarBase::Type::Double:       return static_cast<const Var<double>*>(v)->Value();
+    case VarBase::Type::Int:          return static_cast<const Var<int>*>(v)->Value();
+    case VarBase::Type::Unsigned:     return static_cast<const Var<unsigned>*>(v)->Value();
+    case VarBase::Type::Long:         return static_cast<const Var<long>*>(v)->Value();
+    case VarBase::Type::UnsignedLong: return static_cast<const Var<unsigned long>*>(v)->Value();
+    case VarBase::Type::Char:         return static_cast<const Var<char>*>(v)->Value();
+    case VarBase::Type::UnsignedChar: return static_cast<const Var<unsigned char>*>(v)->Value();
+    default: throw std::invalid_argument("VarEncoder: not a number");
+    }
+  }
+
+  static std::int64_t Signed (const VarBaseSortable *v)
+  {
+    switch (v->GetType()) {
+    case VarBase::Type::Int:  return static_cast<const Var<int>*>(v)->Value();
+    case VarBase::Type::Long: return static_cast<const Var<long>*>(v)->Value();
+    case VarBase::Type::Char: return static_cast<const Var<char>*>(v)->Value();
+    default: throw std::invalid_argument("VarEncoder: not a signed integer");
+    }
+  }
+
+  static std::uint64_t Unsigned (const VarBaseSortable *v)
+  {
+    switch (v->GetType()) {
+    case VarBase::Type::Bool:         return static_cast<const Var<bool>*>(v)->Value();
+    case VarBase::Type::Unsigned:     return static_cast<const Var<unsigned>*>(v)->Value();
+    case VarBase::Type::UnsignedLong: return static_cast<const Var<unsigned long>*>(v)->Value();
+    case VarBase::Type::UnsignedChar: return static_cast<const Var<unsigned char>*>(v)->Value();
+    default: throw std::invalid_argument("VarEncoder: not an unsigned integer");
+    }
+  }
+
+  static const std::string& String (const VarBaseSortable *v)
+  {
+    if (v->GetType() != VarBase::Type::String) throw std::invalid_argument("VarEncoder: not a string");
+    return dynamic_cast<const Var<std::string>&>(*v).Value();
+  }
+
+  /**
+   * Code of the smallest value of integer coordinate d that is >= v (or with
+   * upper, of the largest one <= v); false if there is none
+   */
+  bool IntegerCode (const VarBaseSortable *v, const size_t &d, const bool &upper, Analysis::kd_code &code) const
+  {
+    const bool   isSigned = m_columns[d] == Column::Signed;
+    // range of the coordinate, [lowest, limit)
+    const double lowest   = isSigned ? -std::ldexp(1., 63) : 0.,
+                 limit    = std::ldexp(1., isSigned ? 63 : 64);
+    const auto   largest  = isSigned ? Analysis::kd_encode(std::numeric_limits<std::int64_t>::max())
+                                     : Analysis::kd_encode(std::numeric_limits<std::uint64_t>::max());
+
+    switch (ColumnOf(v->GetType())) {
+    case Column::Signed: {
+      const auto x = Signed(v);
+      if (isSigned) code = Analysis::kd_encode(x);
+      else if (x >= 0) code = Analysis::kd_encode(static_cast<std::uint64_t>(x));
+      else if (upper) return false;
+      else code = Analysis::kd_encode(std::uint64_t(0));
+      return true;
+    }
+    case Column::Unsigned: {
+      const auto x = Unsigned(v);
+      if (!isSigned) code = Analysis::kd_encode(x);
+      else if (x <= static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max()))
+        code = Analysis::kd_encode(static_cast<std::int64_t>(x));
+      else if (!upper) return false;
+      else code = largest;
+      return true;
+    }
+    default: {
+      const double x = upper ? std::floor(Number(v)) : std::ceil(Number(v));
+      if (x != x || (upper && x < lowest) || (!upper && !(x < limit))) return false;
+      if (!(x < limit)) code = largest;
+      else if (isSigned) code = Analysis::kd_encode(static_cast<std::int64_t>(std::max(x, lowest)));
+      else code = Analysis::kd_encode(static_cast<std::uint64_t>(std::max(x, lowest)));
+      return true;
+    }
+    }
+  }
+
+public:
+  /**
+   * Takes iterators to the records (containers of VarBaseSortable*) to encode
+   */
+  template<class ForwardIterator>
+  VarEncoder (ForwardIterator first, ForwardIterator last)
+  {
+    if (first == last) return;
+    for (auto v : *first) {
+      m_types.push_back(v->GetType());
+      m_columns.push_back(ColumnOf(v->GetType()));
+    }
+    m_mixed.assign(m_types.size(), false);
+
+    std::vector<std::vector<std::string>> strings(m_types.size());
+    for (auto it = first; it != last; ++it) {
+      size_t d = 0;
+      for (auto v : *it) {
+        if (m_types[d] == VarBase::Type::String) strings[d].push_back(String(v));
+        else if (v->GetType() != m_types[d]) {
+          m_columns[d] = Column::Number;
+          m_mixed[d]   = true;
+        }
+        ++d;
+      }
+    }
+    for (auto &s : strings) m_strings.emplace_back(s.begin(), s.end());
+  }
+
+  size_t Dim () const {return m_types.size();}
+
+  /**
+   * Throws std::invalid_argument for a value that the coordinate can't hold
+   * exactly (e.g. a fraction, or a negative number, in an integer coordinate)
+   */
+  Analysis::kd_code Encode (const VarBaseSortable *v, const size_t &d) const
+  {
+    switch (m_columns[d]) {
+    case Column::String:
+      return m_strings[d].encode(String(v));
+    case Column::Number:
+      return Analysis::kd_encode(Number(v));
+    default: {
+      Analysis::kd_code lower, upper;
+      if (!this->IntegerCode(v, d, false, lower) || !this->IntegerCode(v, d, true, upper) || lower != upper)
+        throw std::invalid_argument("VarEncoder: value not held by an integer coordinate");
+      return lower;
+    }
+    }
+  }
+
+  /**
+   * Codes of the bounds of [lo, hi] in coordinate d; string bounds need not be
+   * strings of the records, nor numeric bounds of the type of the coordinate
+   * (the range is empty, with first > second, if it holds no value)
+   */
+  std::pair<Analysis::kd_code, Analysis::kd_code> EncodeBounds (const VarBaseSortable *lo, const VarBaseSortable *hi,
+                                                                const size_t &d) const
+  {
+    switch (m_columns[d]) {
+    case Column::String:
+      return { m_strings[d].lower(String(lo)), m_strings[d].upper(String(hi)) };
+    case Column::Number:
+      return { Analysis::kd_encode(Number(lo)), Analysis::kd_encode(Number(hi)) };
+    default: {
+      Analysis::kd_code lower, upper;
+      if (!this->IntegerCode(lo, d, false, lower) || !this->IntegerCode(hi, d, true, upper)) return { 1, 0 };
+      return { lower, upper };
+    }
+    }
+  }
+
+  std::unique_ptr<VarBaseSortable> Decode (const Analysis::kd_code &code, const size_t &d) const
+  {
+    if (m_columns[d] == Column::Signed) {
+      const auto x = Analysis::kd_decode<std::int64_t>(code);
+      switch (m_types[d]) {
+      case VarBase::Type::Int:  return std::unique_ptr<VarBaseSortable>(new Var<int>(static_cast<int>(x)));
+      case VarBase::Type::Long: return std::unique_ptr<VarBaseSortable>(new Var<long>(static_cast<long>(x)));
+      default:                  return std::unique_ptr<VarBaseSortable>(new Var<char>(static_cast<char>(x)));
+      }
+    }
+    if (m_columns[d] == Column::Unsigned) {
+      const auto x = Analysis::kd_decode<std::uint64_t>(code);
+      switch (m_types[d]) {
+      case VarBase::Type::Bool:         return std::unique_ptr<VarBaseSortable>(new Var<bool>(x != 0));
+      case VarBase::Type::Unsigned:     return std::unique_ptr<VarBaseSortable>(new Var<unsigned>(static_cast<unsigned>(x)));
+      case VarBase::Type::UnsignedLong: return std::unique_ptr<VarBaseSortable>(new Var<unsigned long>(static_cast<unsigned long>(x)));
+      default:                          return std::unique_ptr<VarBaseSortable>(new Var<unsigned char>(static_cast<unsigned char>(x)));
+      }
+    }
+
+    if (m_columns[d] == Column::String)
+      return std::unique_ptr<VarBaseSortable>(new Var<std::string>(std::string(m_strings[d].decode(code))));
+    // the other numbers are all floats, all doubles, or mixed
+    const double x = Analysis::kd_decode<double>(code);
+    if (!m_mixed[d] && m_types[d] == VarBase::Type::Float)
+      return std::unique_ptr<VarBaseSortable>(new Var<float>(static_cast<float>(x)));
+    return std::unique_ptr<VarBaseSortable>(new Var<double>(x));
+  }
+};